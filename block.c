@@ -7,60 +7,207 @@
  *
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+//linux/fs.h defines its own BLOCK_SIZE; ours comes from block.h
+#undef BLOCK_SIZE
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #include "block.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+//Default disk size set to 32MB
+#define DISK_SIZE	(32*1024*1024)
 
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+//Backend used for the next dev_init/dev_open (see dev_set_backend)
+static int dev_backend = DEV_PREAD;
+//DEV_DIRECT: the disk file was opened with O_DIRECT
+static int dev_direct = 0;
+//DEV_MMAP: the whole disk file mapped shared, and its length
+static char *dev_map = NULL;
+static size_t dev_map_size = 0;
+
+//Alignment of cache and pool buffers (required by O_DIRECT)
+#define BIO_ALIGN		4096
+
+//Block cache geometry: 256 blocks (1MB) with a power of two hash table
+#define BCACHE_SIZE		256
+#define BCACHE_HASH		512
+//Default number of dirty blocks allowed before the cache writes everything back
+#define BCACHE_DIRTY_LIMIT	64
+//Depth of the io_uring submission queue for DEV_URING
+#define URING_ENTRIES		64
+
+struct bcache_entry {
+	int blkno;						/* cached block number, -1 if unused */
+	int dirty;						/* block differs from the disk copy */
+	int ref;						/* CLOCK reference bit */
+	int busy;						/* being filled from disk; wait on bcache_cond */
+	struct bcache_entry *hnext;		/* next entry in the same hash chain */
+	char *data;						/* BLOCK_SIZE bytes of block data */
+};
+
+static struct bcache_entry bcache[BCACHE_SIZE];
+static struct bcache_entry *bcache_hash[BCACHE_HASH];
+static char *bcache_mem = NULL;
+static int bcache_hand = 0;
+static int bcache_ndirty = 0;
+static int bcache_dirty_limit = BCACHE_DIRTY_LIMIT;
+//Guards the cache, the dirty count and the io_uring ring
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;
+
+static void bcache_init();
+static void bcache_free();
+static int bcache_flush();
+static int uring_complete();
+static int bio_aligned(const void *buf);
+static int bio_all_aligned(const void * const bufs[], int count);
+static int uring_setup(unsigned entries);
+static void uring_free();
+static int uring_active();
+static void uring_queue(int write, int blkno, void *buf, struct bcache_entry *e);
+static void ra_stop();
+
+//Choose how the next dev_init/dev_open drives the disk file
+void dev_set_backend(int backend) {
+	dev_backend = backend;
+}
+
+//Extra open(2) flags for the selected backend
+static int dev_open_flags() {
+	dev_direct = (dev_backend & DEV_DIRECT) && !(dev_backend & DEV_MMAP);
+	return dev_direct ? O_DIRECT : 0;
+}
+
+//Set up the selected backend once the disk file is open
+static int dev_attach() {
+	if (dev_backend & DEV_MMAP) {
+		struct stat st;
+		if (fstat(diskfile, &st) < 0 || st.st_size == 0) {
+			perror("disk_mmap failed");
+			return -1;
+		}
+		dev_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+		if (dev_map == MAP_FAILED) {
+			perror("disk_mmap failed");
+			dev_map = NULL;
+			return -1;
+		}
+		dev_map_size = st.st_size;
+		//Reads are plain memcpy from the page cache, so the block cache is skipped
+		return 0;
+	}
+	if ((dev_backend & DEV_URING) && uring_setup(URING_ENTRIES) < 0) {
+		fprintf(stderr, "io_uring unavailable, using pread/pwrite\n");
+	}
+	bcache_init();
+	return 0;
+}
+
+//Creates a file of disk_size bytes which is your new emulated disk
+void dev_init_size(const char* diskfile_path, uint64_t disk_size) {
     if (diskfile >= 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = open(diskfile_path, O_CREAT | O_RDWR | dev_open_flags(), S_IRUSR | S_IWUSR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    if (ftruncate(diskfile, disk_size) < 0) {
+		perror("disk_init failed");
+		exit(EXIT_FAILURE);
+    }
+	if (dev_attach() < 0) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+//Creates a disk file of the default size
+void dev_init(const char* diskfile_path) {
+	dev_init_size(diskfile_path, DISK_SIZE);
 }
 
-//Function to open the disk file
+//Function to open the disk file; on failure errno is ENOENT only when there is no disk file
 int dev_open(const char* diskfile_path) {
     if (diskfile >= 0) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = open(diskfile_path, O_RDWR | dev_open_flags(), S_IRUSR | S_IWUSR);
     if (diskfile < 0) {
+		int err = errno;
 		perror("disk_open failed");
+		errno = err;
 		return -1;
     }
+	if (dev_attach() < 0) {
+		close(diskfile);
+		diskfile = -1;
+		errno = EIO;
+		return -1;
+	}
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		ra_stop();
+		bio_flush();
+		bcache_free();
+		uring_free();
+		if (dev_map != NULL) {
+			munmap(dev_map, dev_map_size);
+			dev_map = NULL;
+			dev_map_size = 0;
+		}
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
-//Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+//Read a block straight from the disk file, bypassing the cache
+static int dev_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+	if (dev_direct && !bio_aligned(buf)) {
+		void *bounce = bio_alloc();
+		retstat = dev_read(block_num, bounce);
+		memcpy(buf, bounce, BLOCK_SIZE);
+		bio_free(bounce);
+		return retstat;
+	}
+	if (dev_map != NULL) {
+		if ((size_t)(block_num + 1) * BLOCK_SIZE > dev_map_size) {
+			memset(buf, 0, BLOCK_SIZE);
+			return 0;
+		}
+		memcpy(buf, dev_map + (size_t)block_num * BLOCK_SIZE, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -70,13 +217,939 @@ int bio_read(const int block_num, void *buf) {
     return retstat;
 }
 
-//Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
+//Write a block straight to the disk file, bypassing the cache
+static int dev_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+	if (dev_direct && !bio_aligned(buf)) {
+		void *bounce = bio_alloc();
+		memcpy(bounce, buf, BLOCK_SIZE);
+		retstat = dev_write(block_num, bounce);
+		bio_free(bounce);
+		return retstat;
+	}
+	if (dev_map != NULL) {
+		if ((size_t)(block_num + 1) * BLOCK_SIZE > dev_map_size) {
+			fprintf(stderr, "block_write failed: block %d beyond disk\n", block_num);
+			return -1;
+		}
+		memcpy(dev_map + (size_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+/*
+ * Aligned buffer pool
+ *
+ * O_DIRECT needs block buffers aligned to the page size. bio_alloc hands
+ * out BLOCK_SIZE buffers aligned to BIO_ALIGN, recycling released ones
+ * through a small free list instead of going back to the allocator.
+ */
+#define BIO_POOL_KEEP	64
+
+static void *bio_pool[BIO_POOL_KEEP];
+static int bio_pool_count = 0;
+static pthread_mutex_t bio_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bio_aligned(const void *buf) {
+	return ((uintptr_t)buf & (BIO_ALIGN - 1)) == 0;
+}
+
+static int bio_all_aligned(const void * const bufs[], int count) {
+	for (int i = 0; i < count; i++) {
+		if (!bio_aligned(bufs[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//Get a page-aligned BLOCK_SIZE buffer; release it with bio_free
+void *bio_alloc() {
+	void *buf = NULL;
+	pthread_mutex_lock(&bio_pool_lock);
+	if (bio_pool_count > 0) {
+		buf = bio_pool[--bio_pool_count];
+	}
+	pthread_mutex_unlock(&bio_pool_lock);
+	if (buf != NULL) {
+		return buf;
+	}
+	if (posix_memalign(&buf, BIO_ALIGN, BLOCK_SIZE) != 0) {
+		perror("block buffer allocation failed");
+		exit(EXIT_FAILURE);
+	}
+	return buf;
+}
+
+void bio_free(void *buf) {
+	if (buf == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&bio_pool_lock);
+	if (bio_pool_count < BIO_POOL_KEEP) {
+		bio_pool[bio_pool_count++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&bio_pool_lock);
+	free(buf);
+}
+
+/*
+ * Block cache
+ *
+ * bio_read/bio_write are served from a fixed pool of BCACHE_SIZE blocks.
+ * Writes only mark the cached copy dirty; dirty blocks reach the disk when
+ * they are evicted, when more than the dirty limit accumulate, or when
+ * bio_flush() is called.
+ * All cache state is guarded by bcache_lock. A read miss claims its entry
+ * (busy) and drops the lock for the disk read, so misses on different
+ * blocks proceed in parallel; others wanting that block wait for it.
+ */
+static void bcache_init() {
+	if (bcache_mem != NULL) {
+		return;
+	}
+	if (posix_memalign((void **)&bcache_mem, BIO_ALIGN, BCACHE_SIZE * BLOCK_SIZE) != 0) {
+		bcache_mem = NULL;
+		perror("block cache allocation failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < BCACHE_SIZE; i++) {
+		bcache[i].blkno = -1;
+		bcache[i].dirty = 0;
+		bcache[i].ref = 0;
+		bcache[i].busy = 0;
+		bcache[i].hnext = NULL;
+		bcache[i].data = bcache_mem + (size_t)i * BLOCK_SIZE;
+	}
+	memset(bcache_hash, 0, sizeof(bcache_hash));
+	bcache_hand = 0;
+	bcache_ndirty = 0;
+}
+
+static void bcache_free() {
+	free(bcache_mem);
+	bcache_mem = NULL;
+	memset(bcache_hash, 0, sizeof(bcache_hash));
+}
+
+static struct bcache_entry **bcache_bucket(int block_num) {
+	return &bcache_hash[(unsigned int)block_num & (BCACHE_HASH - 1)];
+}
+
+static struct bcache_entry *bcache_lookup(int block_num) {
+	struct bcache_entry *e = *bcache_bucket(block_num);
+	while (e != NULL && e->blkno != block_num) {
+		e = e->hnext;
+	}
+	return e;
+}
+
+//Look block_num up, waiting out a read in flight on it (lock held)
+static struct bcache_entry *bcache_get(int block_num) {
+	struct bcache_entry *e;
+	while ((e = bcache_lookup(block_num)) != NULL && e->busy) {
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+	}
+	return e;
+}
+
+static void bcache_unhash(struct bcache_entry *e) {
+	struct bcache_entry **pp = bcache_bucket(e->blkno);
+	while (*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	e->hnext = NULL;
+}
+
+//Write a dirty entry back to disk and mark it clean
+static int bcache_writeback(struct bcache_entry *e) {
+	if (!e->dirty) {
+		return 0;
+	}
+	if (dev_write(e->blkno, e->data) < 0) {
+		return -1;
+	}
+	e->dirty = 0;
+	bcache_ndirty--;
+	return 0;
+}
+
+//Pick a victim with the CLOCK algorithm and rebind it to block_num
+static struct bcache_entry *bcache_evict(int block_num) {
+	struct bcache_entry *e;
+	for (;;) {
+		e = &bcache[bcache_hand];
+		bcache_hand = (bcache_hand + 1) % BCACHE_SIZE;
+		if (e->blkno < 0) {
+			break;
+		}
+		if (e->busy) {
+			continue;
+		}
+		if (e->ref) {
+			e->ref = 0;
+			continue;
+		}
+		if (bcache_writeback(e) < 0) {
+			//Keep the dirty data rather than losing it; try another slot
+			e->ref = 1;
+			continue;
+		}
+		bcache_unhash(e);
+		break;
+	}
+	e->blkno = block_num;
+	e->dirty = 0;
+	e->ref = 1;
+	e->hnext = *bcache_bucket(block_num);
+	*bcache_bucket(block_num) = e;
+	return e;
+}
+
+static int bcache_cmp_blkno(const void *a, const void *b) {
+	int x = (*(struct bcache_entry * const *)a)->blkno;
+	int y = (*(struct bcache_entry * const *)b)->blkno;
+	return (x > y) - (x < y);
+}
+
+//Write every dirty cached block to disk in ascending block order (lock held)
+static int bcache_flush() {
+	struct bcache_entry *dirty[BCACHE_SIZE];
+	int n = 0, retstat = 0;
+
+	//In mmap mode the page cache already holds the data; bio_sync makes it durable
+	if (bcache_mem == NULL || bcache_ndirty == 0) {
+		return 0;
+	}
+	for (int i = 0; i < BCACHE_SIZE; i++) {
+		if (bcache[i].blkno >= 0 && bcache[i].dirty) {
+			dirty[n++] = &bcache[i];
+		}
+	}
+	qsort(dirty, n, sizeof(dirty[0]), bcache_cmp_blkno);
+	//Keep every dirty block in flight at once when the async backend is up
+	if (uring_active()) {
+		for (int i = 0; i < n; i++) {
+			uring_queue(1, dirty[i]->blkno, dirty[i]->data, dirty[i]);
+		}
+		return uring_complete();
+	}
+	for (int i = 0; i < n; i++) {
+		if (bcache_writeback(dirty[i]) < 0) {
+			retstat = -1;
+		}
+	}
+	return retstat;
+}
+
+int bio_flush() {
+	pthread_mutex_lock(&bcache_lock);
+	int retstat = bcache_flush();
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat;
+}
+
+//Ask the kernel to put what has been written to the disk file on stable
+//storage; bio_flush() only hands the cached blocks to the kernel
+int bio_sync() {
+	int retstat = 0;
+	if (dev_map != NULL) {
+		retstat = msync(dev_map, dev_map_size, MS_SYNC);
+	} else if (diskfile >= 0) {
+		retstat = fdatasync(diskfile);
+	}
+	if (retstat < 0) {
+		perror("bio_sync failed");
+		return -1;
+	}
+	return 0;
+}
+
+//Set how many dirty blocks may accumulate before they are written back
+void bio_set_dirty_limit(int limit) {
+	if (limit < 1) {
+		limit = 1;
+	}
+	if (limit > BCACHE_SIZE) {
+		limit = BCACHE_SIZE;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	bcache_dirty_limit = limit;
+	if (bcache_ndirty >= bcache_dirty_limit) {
+		bcache_flush();
+	}
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+//Read a block through the cache
+int bio_read(const int block_num, void *buf) {
+	struct bcache_entry *e;
+	int retstat;
+
+	if (bcache_mem == NULL) {
+		return dev_read(block_num, buf);
+	}
+	pthread_mutex_lock(&bcache_lock);
+	e = bcache_get(block_num);
+	if (e != NULL) {
+		e->ref = 1;
+		memcpy(buf, e->data, BLOCK_SIZE);
+		pthread_mutex_unlock(&bcache_lock);
+		return BLOCK_SIZE;
+	}
+	//Fill the (aligned) cache buffer first so O_DIRECT never sees buf
+	e = bcache_evict(block_num);
+	e->busy = 1;
+	pthread_mutex_unlock(&bcache_lock);
+	retstat = dev_read(block_num, e->data);
+	pthread_mutex_lock(&bcache_lock);
+	e->busy = 0;
+	pthread_cond_broadcast(&bcache_cond);
+	if (retstat < 0) {
+		bcache_unhash(e);
+		e->blkno = -1;
+	} else {
+		memcpy(buf, e->data, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat;
+}
+
+//Write a block through the cache; the disk is updated lazily
+int bio_write(const int block_num, const void *buf) {
+	struct bcache_entry *e;
+
+	if (bcache_mem == NULL) {
+		return dev_write(block_num, buf);
+	}
+	pthread_mutex_lock(&bcache_lock);
+	e = bcache_get(block_num);
+	if (e == NULL) {
+		e = bcache_evict(block_num);
+	}
+	e->ref = 1;
+	memcpy(e->data, buf, BLOCK_SIZE);
+	if (!e->dirty) {
+		e->dirty = 1;
+		bcache_ndirty++;
+	}
+	int retstat = BLOCK_SIZE;
+	if (bcache_ndirty >= bcache_dirty_limit && bcache_flush() < 0) {
+		retstat = -1;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//Read count adjacent blocks from the disk file into bufs with preadv
+static int dev_readv(const int start, const int count, void * const bufs[]) {
+	struct iovec iov[IOV_MAX];
+	int done = 0;
+
+	if (dev_map != NULL || (dev_direct && !bio_all_aligned((const void * const *)bufs, count))) {
+		for (int i = 0; i < count; i++) {
+			if (dev_read(start + i, bufs[i]) < 0) {
+				return -1;
+			}
+		}
+		return count * BLOCK_SIZE;
+	}
+
+	while (done < count) {
+		int n = count - done;
+		if (n > IOV_MAX) {
+			n = IOV_MAX;
+		}
+		for (int i = 0; i < n; i++) {
+			iov[i].iov_base = bufs[done + i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+		ssize_t retstat = preadv(diskfile, iov, n, (off_t)(start + done) * BLOCK_SIZE);
+		if (retstat < 0) {
+			perror("block_readv failed");
+			return -1;
+		}
+		//Anything past the end of the disk file reads as zeros
+		for (int i = retstat / BLOCK_SIZE; i < n; i++) {
+			size_t have = (i == retstat / BLOCK_SIZE) ? retstat % BLOCK_SIZE : 0;
+			memset((char *)bufs[done + i] + have, 0, BLOCK_SIZE - have);
+		}
+		done += n;
+	}
+	return count * BLOCK_SIZE;
+}
+
+//Write count adjacent blocks from bufs to the disk file with pwritev
+static int dev_writev(const int start, const int count, const void * const bufs[]) {
+	struct iovec iov[IOV_MAX];
+	int done = 0;
+
+	if (dev_map != NULL || (dev_direct && !bio_all_aligned(bufs, count))) {
+		for (int i = 0; i < count; i++) {
+			if (dev_write(start + i, bufs[i]) < 0) {
+				return -1;
+			}
+		}
+		return count * BLOCK_SIZE;
+	}
+
+	while (done < count) {
+		int n = count - done;
+		if (n > IOV_MAX) {
+			n = IOV_MAX;
+		}
+		for (int i = 0; i < n; i++) {
+			iov[i].iov_base = (void *)bufs[done + i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+		ssize_t retstat = pwritev(diskfile, iov, n, (off_t)(start + done) * BLOCK_SIZE);
+		if (retstat < (ssize_t)n * BLOCK_SIZE) {
+			perror("block_writev failed");
+			return -1;
+		}
+		done += n;
+	}
+	return count * BLOCK_SIZE;
+}
+
+/*
+ * Vectored multi-block I/O
+ *
+ * bio_readv/bio_writev move count adjacent blocks starting at start, one
+ * buffer per block. Blocks already in the cache are served from (or
+ * updated in) the cache; every run of uncached blocks between them is
+ * transferred with a single preadv/pwritev. Bulk transfers do not
+ * populate the cache so that streaming I/O cannot flush out metadata.
+ * The disk transfers run without bcache_lock held.
+ */
+int bio_readv(const int start, const int count, void * const bufs[]) {
+	int run = 0;
+
+	for (int i = 0; i <= count; i++) {
+		struct bcache_entry *e = NULL;
+		if (i < count && bcache_mem != NULL) {
+			pthread_mutex_lock(&bcache_lock);
+			e = bcache_get(start + i);
+			if (e != NULL) {
+				e->ref = 1;
+				memcpy(bufs[i], e->data, BLOCK_SIZE);
+			}
+			pthread_mutex_unlock(&bcache_lock);
+		}
+		if (i < count && e == NULL) {
+			continue;
+		}
+		//Flush the run of uncached blocks that ends before block i
+		if (i > run && dev_readv(start + run, i - run, bufs + run) < 0) {
+			return -1;
+		}
+		run = i + 1;
+	}
+	return count * BLOCK_SIZE;
+}
+
+int bio_writev(const int start, const int count, const void * const bufs[]) {
+	if (dev_writev(start, count, bufs) < 0) {
+		return -1;
+	}
+	//Cached copies now match the disk
+	if (bcache_mem == NULL) {
+		return count * BLOCK_SIZE;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count; i++) {
+		struct bcache_entry *e = bcache_get(start + i);
+		if (e != NULL) {
+			memcpy(e->data, bufs[i], BLOCK_SIZE);
+			if (e->dirty) {
+				e->dirty = 0;
+				bcache_ndirty--;
+			}
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return count * BLOCK_SIZE;
+}
+
+//Read count adjacent blocks into one contiguous buffer
+int bio_read_range(const int start, const int count, void *buf) {
+	void *bufs[count];
+	for (int i = 0; i < count; i++) {
+		bufs[i] = (char *)buf + (size_t)i * BLOCK_SIZE;
+	}
+	return bio_readv(start, count, bufs);
+}
+
+//Write count adjacent blocks from one contiguous buffer
+int bio_write_range(const int start, const int count, const void *buf) {
+	const void *bufs[count];
+	for (int i = 0; i < count; i++) {
+		bufs[i] = (const char *)buf + (size_t)i * BLOCK_SIZE;
+	}
+	return bio_writev(start, count, bufs);
+}
+
+/*
+ * Zero-copy access for DEV_MMAP: a read-only pointer straight into the
+ * mapped disk. Returns NULL for other backends (or out of range blocks),
+ * in which case the caller falls back to bio_read.
+ */
+const void *bio_map(const int block_num) {
+	if (dev_map == NULL || block_num < 0 ||
+			(size_t)(block_num + 1) * BLOCK_SIZE > dev_map_size) {
+		return NULL;
+	}
+	return dev_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+/*
+ * Let a caller read or write blocks [start, start+count) straight through
+ * the disk file descriptor (e.g. to splice them): dirty cached copies of
+ * those blocks are written back first, and a writer calls bio_invalidate()
+ * afterwards. Returns the descriptor, or -1 when the file cannot be used
+ * that way (O_DIRECT needs aligned transfers); a count of 0 just asks.
+ */
+int bio_fd_range(const int start, const int count) {
+	int retstat = diskfile;
+
+	if (diskfile < 0 || dev_direct) {
+		return -1;
+	}
+	//A shared mapping and the descriptor see the same page cache
+	if (dev_map != NULL || bcache_mem == NULL) {
+		return diskfile;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count; i++) {
+		struct bcache_entry *e = bcache_lookup(start + i);
+		if (e != NULL && !e->busy && bcache_writeback(e) < 0) {
+			retstat = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat;
+}
+
+/*
+ * Forget the cached copies of blocks [start, start+count), which the
+ * caller has rewritten on disk through the descriptor from bio_fd_range().
+ * Reads in flight on them are waited out so no stale copy stays behind.
+ */
+void bio_invalidate(const int start, const int count) {
+	if (dev_map != NULL || bcache_mem == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count; i++) {
+		struct bcache_entry *e = bcache_get(start + i);
+		if (e == NULL) {
+			continue;
+		}
+		if (e->dirty) {
+			e->dirty = 0;
+			bcache_ndirty--;
+		}
+		bcache_unhash(e);
+		e->blkno = -1;
+		e->ref = 0;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+/*
+ * Readahead
+ *
+ * bio_prefetch() queues a run of blocks to be read into the cache and
+ * returns at once. A worker thread, started on first use, reads whichever
+ * of them are not cached yet: it claims their entries busy, like a read
+ * miss, so a reader that gets there first waits for the data instead of
+ * reading it again, and fetches each adjacent run with one preadv.
+ * Prefetched blocks enter the cache with their CLOCK bit clear, so ones
+ * nobody reads are the first to be evicted. With DEV_MMAP the kernel is
+ * asked to read the pages in instead.
+ */
+#define RA_QUEUE		16
+//Most blocks one request may claim, leaving the rest of the cache to readers
+#define RA_MAX_BLOCKS	(BCACHE_SIZE / 4)
+
+struct ra_req {
+	int start;
+	int count;
+};
+
+static struct ra_req ra_queue[RA_QUEUE];
+static int ra_head = 0;
+static int ra_len = 0;
+static int ra_state = 0;			/* 0: no worker, 1: running, 2: stopping */
+static pthread_t ra_worker;
+//Guards the request queue and ra_state
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+
+//Read the uncached blocks of one request into the cache
+static void ra_fill(int start, int count) {
+	struct bcache_entry *claimed[RA_MAX_BLOCKS];
+	void *bufs[RA_MAX_BLOCKS];
+	char failed[RA_MAX_BLOCKS];
+	int n = 0;
+
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count && bcache_mem != NULL; i++) {
+		if (bcache_lookup(start + i) != NULL) {
+			continue;
+		}
+		struct bcache_entry *e = bcache_evict(start + i);
+		e->busy = 1;
+		e->ref = 0;
+		bufs[n] = e->data;
+		claimed[n++] = e;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+
+	for (int i = 0; i < n; ) {
+		int run = 1;
+		while (i + run < n && claimed[i + run]->blkno == claimed[i]->blkno + run) {
+			run++;
+		}
+		//A failed run is dropped below and left for a real read to retry
+		memset(failed + i, dev_readv(claimed[i]->blkno, run, bufs + i) < 0, run);
+		i += run;
+	}
+
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < n; i++) {
+		claimed[i]->busy = 0;
+		if (failed[i]) {
+			bcache_unhash(claimed[i]);
+			claimed[i]->blkno = -1;
+		}
+	}
+	pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+static void *ra_main(void *arg) {
+	pthread_mutex_lock(&ra_lock);
+	for (;;) {
+		while (ra_len == 0 && ra_state == 1) {
+			pthread_cond_wait(&ra_cond, &ra_lock);
+		}
+		if (ra_state != 1) {
+			break;
+		}
+		struct ra_req r = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % RA_QUEUE;
+		ra_len--;
+		pthread_mutex_unlock(&ra_lock);
+		ra_fill(r.start, r.count);
+		pthread_mutex_lock(&ra_lock);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return NULL;
+}
+
+//Stop the worker and drop whatever it had not read yet
+static void ra_stop() {
+	pthread_mutex_lock(&ra_lock);
+	if (ra_state != 1) {
+		pthread_mutex_unlock(&ra_lock);
+		return;
+	}
+	ra_state = 2;
+	pthread_cond_broadcast(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_worker, NULL);
+	pthread_mutex_lock(&ra_lock);
+	ra_state = 0;
+	ra_len = 0;
+	pthread_mutex_unlock(&ra_lock);
+}
+
+//Start reading count blocks from start into the cache in the background
+int bio_prefetch(const int start, const int count) {
+	if (count <= 0 || start < 0 || diskfile < 0) {
+		return 0;
+	}
+	if (dev_map != NULL) {
+		size_t off = (size_t)start * BLOCK_SIZE;
+		size_t len = (size_t)count * BLOCK_SIZE;
+		if (off >= dev_map_size) {
+			return 0;
+		}
+		if (len > dev_map_size - off) {
+			len = dev_map_size - off;
+		}
+		return madvise(dev_map + off, len, MADV_WILLNEED);
+	}
+	if (bcache_mem == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&ra_lock);
+	if (ra_state == 0 && pthread_create(&ra_worker, NULL, ra_main, NULL) == 0) {
+		ra_state = 1;
+	}
+	//Readahead is only a hint: whatever does not fit in the queue is dropped
+	for (int done = 0; ra_state == 1 && done < count && ra_len < RA_QUEUE; ) {
+		struct ra_req *r = &ra_queue[(ra_head + ra_len) % RA_QUEUE];
+		r->start = start + done;
+		r->count = count - done < RA_MAX_BLOCKS ? count - done : RA_MAX_BLOCKS;
+		done += r->count;
+		ra_len++;
+	}
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	return 0;
+}
+
+/*
+ * Asynchronous I/O (DEV_URING)
+ *
+ * Cache writeback queues the dirty blocks on an io_uring submission ring
+ * and hands them to the kernel in batches, so many blocks are in flight
+ * at once. The ring is driven with the raw syscalls to avoid a liburing
+ * dependency. Without a ring bcache_flush() writes the blocks one by one,
+ * and a request the kernel rejects (e.g. an opcode older kernels lack) is
+ * retried with pread/pwrite.
+ */
+struct uring_req {
+	int write;						/* 1 for a write, 0 for a read */
+	int blkno;						/* block being transferred */
+	void *buf;						/* caller's BLOCK_SIZE buffer */
+	struct bcache_entry *e;			/* cache entry to mark clean, or NULL */
+	int next;						/* next free slot */
+};
+
+static int async_err = 0;
+
+#ifdef HAVE_IO_URING
+static struct {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+	unsigned queued;				/* on the SQ ring, not yet entered */
+	unsigned inflight;				/* queued or entered, not yet reaped */
+	struct uring_req reqs[URING_ENTRIES];
+	int free_req;
+} ring = { .fd = -1 };
+
+static int uring_setup(unsigned entries) {
+	struct io_uring_params p;
+
+	if (ring.fd >= 0) {
+		return 0;
+	}
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring.fd < 0) {
+		return -1;
+	}
+	ring.entries = p.sq_entries < URING_ENTRIES ? p.sq_entries : URING_ENTRIES;
+	ring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_ring_len > ring.sq_ring_len) {
+			ring.sq_ring_len = ring.cq_ring_len;
+		}
+		ring.cq_ring_len = ring.sq_ring_len;
+	}
+	ring.sq_ring = mmap(NULL, ring.sq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ring = ring.sq_ring;
+	} else {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED) {
+			munmap(ring.sq_ring, ring.sq_ring_len);
+			goto fail;
+		}
+	}
+	ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		if (ring.cq_ring != ring.sq_ring) {
+			munmap(ring.cq_ring, ring.cq_ring_len);
+		}
+		munmap(ring.sq_ring, ring.sq_ring_len);
+		goto fail;
+	}
+	ring.sq_head = (unsigned *)((char *)ring.sq_ring + p.sq_off.head);
+	ring.sq_tail = (unsigned *)((char *)ring.sq_ring + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)((char *)ring.sq_ring + p.sq_off.array);
+	ring.cq_head = (unsigned *)((char *)ring.cq_ring + p.cq_off.head);
+	ring.cq_tail = (unsigned *)((char *)ring.cq_ring + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+	ring.queued = 0;
+	ring.inflight = 0;
+	for (unsigned i = 0; i < ring.entries; i++) {
+		ring.reqs[i].next = (i + 1 < ring.entries) ? (int)i + 1 : -1;
+	}
+	ring.free_req = 0;
+	return 0;
+
+fail:
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+
+static void uring_free() {
+	if (ring.fd < 0) {
+		return;
+	}
+	uring_complete();
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_ring != ring.sq_ring) {
+		munmap(ring.cq_ring, ring.cq_ring_len);
+	}
+	munmap(ring.sq_ring, ring.sq_ring_len);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+static int uring_active() {
+	return ring.fd >= 0;
+}
+
+//Finish one request: retry failures synchronously, then update the cache entry
+static void uring_finish(struct uring_req *r, int res) {
+	if (res != BLOCK_SIZE) {
+		res = r->write ? dev_write(r->blkno, r->buf) : dev_read(r->blkno, r->buf);
+		if (res < 0 || (r->write && res != BLOCK_SIZE)) {
+			async_err = -1;
+			return;
+		}
+	}
+	if (r->write && r->e != NULL && r->e->dirty) {
+		r->e->dirty = 0;
+		bcache_ndirty--;
+	}
+}
+
+//Hand queued SQEs to the kernel, optionally waiting for min_complete CQEs
+static int uring_enter(unsigned min_complete) {
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring.fd, ring.queued, min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		return -1;
+	}
+	ring.queued -= (unsigned)ret < ring.queued ? (unsigned)ret : ring.queued;
+	return 0;
+}
+
+//Reap every CQE that is already posted
+static void uring_reap() {
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		int idx = (int)cqe->user_data;
+		uring_finish(&ring.reqs[idx], cqe->res);
+		ring.reqs[idx].next = ring.free_req;
+		ring.free_req = idx;
+		ring.inflight--;
+		head++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_queue(int write, int blkno, void *buf, struct bcache_entry *e) {
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	int idx;
+
+	//Make room: push what is queued and wait for at least one completion
+	while (ring.free_req < 0) {
+		if (uring_enter(1) < 0) {
+			break;
+		}
+		uring_reap();
+	}
+	if (ring.free_req < 0) {
+		//The ring is wedged; do this one the slow way
+		struct uring_req r = { write, blkno, buf, e, -1 };
+		uring_finish(&r, -1);
+		return;
+	}
+	idx = ring.free_req;
+	ring.free_req = ring.reqs[idx].next;
+	ring.reqs[idx].write = write;
+	ring.reqs[idx].blkno = blkno;
+	ring.reqs[idx].buf = buf;
+	ring.reqs[idx].e = e;
+
+	tail = *ring.sq_tail;
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = diskfile;
+	sqe->off = (off_t)blkno * BLOCK_SIZE;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = BLOCK_SIZE;
+	sqe->user_data = idx;
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	ring.inflight++;
+}
+#else
+static int uring_setup(unsigned entries) {
+	return -1;
+}
+
+static void uring_free() {
+}
+
+static int uring_active() {
+	return 0;
+}
+
+static void uring_queue(int write, int blkno, void *buf, struct bcache_entry *e) {
+}
+#endif
+
+//Wait for every queued request; returns -1 if any of them failed. Called with bcache_lock held
+static int uring_complete() {
+	int retstat;
+#ifdef HAVE_IO_URING
+	while (uring_active() && ring.inflight > 0) {
+		if (uring_enter(1) < 0) {
+			perror("io_uring_enter failed");
+			async_err = -1;
+			break;
+		}
+		uring_reap();
+	}
+#endif
+	retstat = async_err;
+	async_err = 0;
+	return retstat;
+}
@@ -8,12 +8,35 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096
 
+//Disk backends for dev_set_backend(); DEV_DIRECT may be or'ed with the others
+#define DEV_PREAD	0	/* pread/pwrite behind the block cache */
+#define DEV_MMAP	1	/* whole disk file mapped, bio_map() available */
+#define DEV_URING	2	/* like DEV_PREAD, with io_uring for batched writeback */
+#define DEV_DIRECT	4	/* open with O_DIRECT, bypassing the host page cache */
+
+void dev_set_backend(int backend);
 void dev_init(const char* diskfile_path);
+void dev_init_size(const char* diskfile_path, uint64_t disk_size);
 int dev_open(const char* diskfile_path);
 void dev_close();
+void *bio_alloc();
+void bio_free(void *buf);
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int start, const int count, void * const bufs[]);
+int bio_writev(const int start, const int count, const void * const bufs[]);
+int bio_read_range(const int start, const int count, void *buf);
+int bio_write_range(const int start, const int count, const void *buf);
+int bio_flush();
+int bio_sync();
+const void *bio_map(const int block_num);
+int bio_fd_range(const int start, const int count);
+void bio_invalidate(const int start, const int count);
+int bio_prefetch(const int start, const int count);
+void bio_set_dirty_limit(int limit);
 
 #endif
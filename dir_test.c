@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./rufs.h"
+
+/*
+ * Directory test: make a disk with compact directory records, add names
+ * of many lengths to the root, remove some and add others back, and check
+ * after every step that each name is found (or not) and that the root's
+ * blocks hold exactly the live records, packed from the start of each
+ * block with zeros after them. Then keep adding until the root is
+ * converted to a hashed directory and check lookups and removals there.
+ * Both kinds of directory are also listed a batch at a time, with names
+ * removed and added between batches, checking that each name there all
+ * along is listed exactly once.
+ */
+
+#define DISKFILE_PATH "dir_test_DISKFILE"
+
+// Enough names to fill most of the two blocks a linear directory may have
+#define NLINEAR 150
+// Enough to need a hashed index with split buckets
+#define NHASHED 3000
+// Names added while a listing is under way
+#define NLATE 1000
+#define NNAMES (NHASHED + NLATE)
+#define INO(i) (100 + (i))
+// Entries a listing takes at a time
+#define BATCH 50
+
+extern char diskfile_path[PATH_MAX];
+
+static char present[NNAMES];
+
+// Name i is "n<i>" padded with 'x' to between 1 and 40 extra characters
+static size_t name_of(int i, char *name) {
+    int len = sprintf(name, "n%d", i);
+    int pad = 1 + (i * 7) % 40;
+    memset(name + len, 'x', pad);
+    name[len + pad] = '\0';
+    return len + pad;
+}
+
+static int add(int i) {
+    struct inode root;
+    char name[64];
+    size_t len = name_of(i, name);
+    if (readi(0, &root) < 0 || dir_add(root, INO(i), name, len) < 0) {
+        printf("Adding %s failed.\n", name);
+        return -1;
+    }
+    present[i] = 1;
+    return 0;
+}
+
+static int del(int i) {
+    struct inode root;
+    char name[64];
+    size_t len = name_of(i, name);
+    if (readi(0, &root) < 0 || dir_remove(root, name, len) < 0) {
+        printf("Removing %s failed.\n", name);
+        return -1;
+    }
+    present[i] = 0;
+    return 0;
+}
+
+static int check_lookups(int n, const char *step) {
+    struct dirent ent;
+    char name[64];
+    for (int i = 0; i < n; i++) {
+        size_t len = name_of(i, name);
+        int ret = dir_find(0, name, len, &ent);
+        if (present[i] && (ret < 0 || ent.ino != INO(i))) {
+            printf("%s: %s not found\n", step, name);
+            return -1;
+        }
+        if (!present[i] && ret == 0) {
+            printf("%s: removed %s still found\n", step, name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Every record in the linear root is live and they leave no gaps
+static int check_packed(int n, const char *step) {
+    struct inode root;
+    char *buf = malloc(BLOCK_SIZE);
+    int live = 0, found = 0;
+
+    readi(0, &root);
+    for (int i = 0; i < n; i++) {
+        live += present[i];
+    }
+    for (int blk = 0; blk < 16 && root.direct_ptr[blk] != 0; blk++) {
+        bio_read(root.direct_ptr[blk], buf);
+        size_t pos = 0;
+        while (pos + sizeof(struct dirent_rec) <= BLOCK_SIZE) {
+            struct dirent_rec *r = (struct dirent_rec *)(buf + pos);
+            if (r->rec_len == 0) {
+                break;
+            }
+            // mkfs gave the root "." and ".."
+            if (r->ino == 0 && r->name_len <= 2 && memcmp(r->name, "..", r->name_len) == 0) {
+                pos += r->rec_len;
+                continue;
+            }
+            if (r->name_len == 0 || r->ino < INO(0) || r->ino >= INO(n) || !present[r->ino - INO(0)]) {
+                printf("%s: block %d has a stale record at %zu\n", step, blk, pos);
+                free(buf);
+                return -1;
+            }
+            found++;
+            pos += r->rec_len;
+        }
+        for (size_t k = pos; k < BLOCK_SIZE; k++) {
+            if (buf[k] != 0) {
+                printf("%s: block %d has data past its records at %zu\n", step, blk, k);
+                free(buf);
+                return -1;
+            }
+        }
+    }
+    free(buf);
+    if (found != live) {
+        printf("%s: %d records for %d names\n", step, found, live);
+        return -1;
+    }
+    return 0;
+}
+
+static int check(int n, int linear, const char *step) {
+    if (check_lookups(n, step) < 0 || (linear && check_packed(n, step) < 0)) {
+        return -1;
+    }
+    printf("%s: ok\n", step);
+    return 0;
+}
+
+struct listing {
+    int n;
+    off_t next;
+    int seen[NNAMES];
+};
+
+static int list_entry(void *arg, const struct dirent *ent, off_t next) {
+    struct listing *l = arg;
+    // the root's "." and ".." name inode 0
+    if (ent->ino >= INO(0) && ent->ino < INO(NNAMES)) {
+        l->seen[ent->ino - INO(0)]++;
+    }
+    l->next = next;
+    return ++l->n == BATCH;
+}
+
+/*
+ * List the root a batch at a time, between batches removing two of the
+ * first n names (wherever the listing is) and adding two from late on, and
+ * check that names there throughout come exactly once, removed ones at
+ * most once, and no other name at all.
+ */
+static int check_listing(int n, int late, const char *step) {
+    static struct listing l;
+    static char before[NNAMES], removed[NNAMES];
+    int victim = 0;
+
+    memset(&l, 0, sizeof(l));
+    memcpy(before, present, sizeof(before));
+    memset(removed, 0, sizeof(removed));
+    for (;;) {
+        l.n = 0;
+        if (dir_foreach(0, l.next, list_entry, &l) < 0) {
+            printf("%s: listing failed\n", step);
+            return -1;
+        }
+        if (l.n < BATCH) {
+            break;
+        }
+        for (int k = 0; k < 2; k++) {
+            while (!present[victim % n]) {
+                victim += 7;
+            }
+            removed[victim % n] = 1;
+            if (del(victim % n) < 0) {
+                return -1;
+            }
+            if (late < NNAMES && add(late++) < 0) {
+                return -1;
+            }
+        }
+    }
+    for (int i = 0; i < NNAMES; i++) {
+        char name[64];
+        name_of(i, name);
+        if (before[i] && !removed[i] && l.seen[i] != 1) {
+            printf("%s: %s listed %d times\n", step, name, l.seen[i]);
+            return -1;
+        }
+        if (l.seen[i] > 1 || (!before[i] && l.seen[i] > present[i])) {
+            printf("%s: %s listed %d times\n", step, name, l.seen[i]);
+            return -1;
+        }
+    }
+    printf("%s: ok\n", step);
+    return late;
+}
+
+int main() {
+    struct inode root;
+
+    strcpy(diskfile_path, DISKFILE_PATH);
+    unlink(DISKFILE_PATH);
+    if (rufs_mkfs(DEFAULT_DISK_SIZE, DEFAULT_INUM, BLOCK_SIZE, FEATURE_COMPACT_DIRENT) < 0) {
+        printf("mkfs failed.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < NLINEAR; i++) {
+        if (add(i) < 0) {
+            return 1;
+        }
+    }
+    readi(0, &root);
+    if (root.flags & INODE_DIR_HASHED) {
+        printf("Root hashed after only %d names.\n", NLINEAR);
+        return 1;
+    }
+    if (check(NLINEAR, 1, "added") < 0) {
+        return 1;
+    }
+
+    // Removing every third name slides the records after each one down
+    for (int i = 0; i < NLINEAR; i += 3) {
+        if (del(i) < 0) {
+            return 1;
+        }
+    }
+    if (check(NLINEAR, 1, "every third removed") < 0) {
+        return 1;
+    }
+
+    // The first and last records of the directory
+    if (del(1) < 0 || del(NLINEAR - 1) < 0 || check(NLINEAR, 1, "ends removed") < 0) {
+        return 1;
+    }
+
+    // Names put back go into the space the removals freed
+    for (int i = 0; i < NLINEAR; i += 3) {
+        if (add(i) < 0) {
+            return 1;
+        }
+    }
+    if (check(NLINEAR, 1, "added back") < 0) {
+        return 1;
+    }
+
+    // Listing while records slide and the root may be hashed; then put the
+    // names removed back and drop the ones added
+    int late = check_listing(NLINEAR, NHASHED, "linear listing");
+    if (late < 0) {
+        return 1;
+    }
+    for (int i = 0; i < NLINEAR; i++) {
+        if (!present[i] && add(i) < 0) {
+            return 1;
+        }
+    }
+    for (int i = NHASHED; i < late; i++) {
+        if (del(i) < 0) {
+            return 1;
+        }
+    }
+
+    // Grow the root until it is hashed, then remove half of it
+    for (int i = NLINEAR; i < NHASHED; i++) {
+        if (add(i) < 0) {
+            return 1;
+        }
+    }
+    readi(0, &root);
+    if (!(root.flags & INODE_DIR_HASHED)) {
+        printf("Root not hashed after %d names.\n", NHASHED);
+        return 1;
+    }
+    if (check(NHASHED, 0, "hashed") < 0) {
+        return 1;
+    }
+
+    // Listing while buckets split under it
+    if (check_listing(NHASHED, late, "hashed listing") < 0 || check(NNAMES, 0, "hashed after listing") < 0) {
+        return 1;
+    }
+    for (int i = 0; i < NHASHED; i += 2) {
+        if (present[i] && del(i) < 0) {
+            return 1;
+        }
+    }
+    if (check(NHASHED, 0, "half of hashed removed") < 0) {
+        return 1;
+    }
+
+    unlink(DISKFILE_PATH);
+    printf("Test completed.\n");
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./rufs.h"
+
+/*
+ * Extent tree test: make a disk with extents, map one file with thousands
+ * of separate runs so the tree's leaves split and its root grows to depth
+ * 2, then unmap ranges that run across several nodes and check every
+ * block's mapping after each step.
+ */
+
+#define DISKFILE_PATH "ext_test_DISKFILE"
+
+// Each run maps RUN_LEN logical blocks; a one block gap on "disk" after
+// every run keeps neighbouring runs from merging into one extent. The disk
+// blocks are never read or written, they only have to be distinct.
+#define NRUNS 3000
+#define RUN_LEN 3
+#define NBLKS (NRUNS * RUN_LEN)
+#define PBLK_BASE 0x100000
+#define PBLK(lb) (PBLK_BASE + (lb) + (lb) / RUN_LEN)
+
+extern char diskfile_path[PATH_MAX];
+
+static char unmapped[NBLKS];
+
+static int check(struct inode *inode, const char *step) {
+    for (int lb = 0; lb < NBLKS; lb++) {
+        int want = unmapped[lb] ? 0 : PBLK(lb);
+        int got = bmap(inode, lb);
+        if (got != want) {
+            printf("%s: block %d maps to %d, expected %d\n", step, lb, got, want);
+            return -1;
+        }
+    }
+    printf("%s: ok (tree depth %d)\n", step, ((struct ext_header *)inode->ext_root)->depth);
+    return 0;
+}
+
+static int unmap(struct inode *inode, int lb) {
+    unmapped[lb] = 1;
+    return bmap_set(inode, lb, 0);
+}
+
+int main() {
+    struct inode inode;
+    int max_depth = 0;
+
+    strcpy(diskfile_path, DISKFILE_PATH);
+    unlink(DISKFILE_PATH);
+    if (rufs_mkfs(DEFAULT_DISK_SIZE, DEFAULT_INUM, BLOCK_SIZE, FEATURE_EXTENTS) < 0) {
+        printf("mkfs failed.\n");
+        return 1;
+    }
+    memset(&inode, 0, sizeof(inode));
+    bmap_format(&inode);
+    if (!(inode.flags & INODE_EXTENTS)) {
+        printf("File not mapped by an extent tree.\n");
+        return 1;
+    }
+    struct ext_header *root = (struct ext_header *)inode.ext_root;
+
+    // Even runs front to back, then odd runs back to front, so new extents
+    // go both after and before everything in a node
+    for (int r = 0; r < NRUNS; r += 2) {
+        if (bmap_set_range(&inode, r * RUN_LEN, PBLK(r * RUN_LEN), RUN_LEN) != RUN_LEN) {
+            printf("Mapping run %d failed.\n", r);
+            return 1;
+        }
+        if (root->depth > max_depth) {
+            max_depth = root->depth;
+        }
+    }
+    memset(unmapped, 1, sizeof(unmapped));
+    for (int r = 0; r < NRUNS; r += 2) {
+        memset(unmapped + r * RUN_LEN, 0, RUN_LEN);
+    }
+    if (check(&inode, "even runs") < 0) {
+        return 1;
+    }
+    for (int r = (NRUNS - 1) | 1; r > 0; r -= 2) {
+        if (r >= NRUNS) {
+            continue;
+        }
+        if (bmap_set_range(&inode, r * RUN_LEN, PBLK(r * RUN_LEN), RUN_LEN) != RUN_LEN) {
+            printf("Mapping run %d failed.\n", r);
+            return 1;
+        }
+    }
+    memset(unmapped, 0, sizeof(unmapped));
+    if (check(&inode, "all runs") < 0) {
+        return 1;
+    }
+
+    // Leaves hold EXT_NODE_MAX extents and the root EXT_ROOT_MAX entries,
+    // so NRUNS extents need split leaves under a root pushed down twice
+    if (max_depth < 1 || root->depth != 2) {
+        printf("Tree depth %d, expected 2.\n", root->depth);
+        return 1;
+    }
+    int len = 0;
+    if (bmap_extent(&inode, RUN_LEN, &len) != PBLK(RUN_LEN) || len != RUN_LEN) {
+        printf("Run 1 is not a single extent of %d blocks.\n", RUN_LEN);
+        return 1;
+    }
+
+    // Unmap a range spanning several leaves from the end, as a failed
+    // write gives its blocks back, starting and ending inside runs
+    for (int lb = 2500; lb >= 1001; lb--) {
+        if (unmap(&inode, lb) < 0) {
+            printf("Unmapping block %d failed.\n", lb);
+            return 1;
+        }
+    }
+    if (check(&inode, "range unmapped backwards") < 0) {
+        return 1;
+    }
+
+    // The same front to back
+    for (int lb = 4000; lb < 6002; lb++) {
+        if (unmap(&inode, lb) < 0) {
+            printf("Unmapping block %d failed.\n", lb);
+            return 1;
+        }
+    }
+    if (check(&inode, "range unmapped forwards") < 0) {
+        return 1;
+    }
+
+    // Taking the middle block out of runs splits each extent in two,
+    // adding extents (and splitting leaves) across the rest of the tree
+    for (int lb = 6000 + 1; lb < NBLKS; lb += RUN_LEN) {
+        if (unmap(&inode, lb) < 0) {
+            printf("Unmapping block %d failed.\n", lb);
+            return 1;
+        }
+    }
+    if (check(&inode, "middle blocks unmapped") < 0) {
+        return 1;
+    }
+
+    unlink(DISKFILE_PATH);
+    printf("Test completed.\n");
+    return 0;
+}
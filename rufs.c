@@ -5,9 +5,17 @@
  *
  */
 
+#ifdef RUFS_LOWLEVEL
+#define FUSE_USE_VERSION 31
+#else
 #define FUSE_USE_VERSION 26
+#endif
 
+#define _GNU_SOURCE
 #include <fuse.h>
+#ifdef RUFS_LOWLEVEL
+#include <fuse_lowlevel.h>
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,14 +26,47 @@
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include "block.h"
 #include "rufs.h"
 
 #define DIR_TYPE 2;
+#define FILE_TYPE 1
 
 char diskfile_path[PATH_MAX];
 
+//RUFS specific mount options, removed from argv before fuse_main sees them
+struct rufs_options {
+	int mmap;		/* -o mmap: map the disk file instead of pread/pwrite */
+	int uring;		/* -o uring: batch writeback through io_uring */
+	int direct;		/* -o direct: open the disk file with O_DIRECT */
+	char *size_str;	/* -o disk_size=N[KMG]: size of a newly made disk */
+	uint64_t disk_size;
+	uint32_t inodes;	/* -o inodes=N: inode count of a newly made disk */
+	int compact_dirs;	/* -o compact_dirs: make the new disk with variable-length dirents */
+	int extents;		/* -o extents: map the new disk's files with extent trees */
+	int dirty_limit;	/* -o dirty_limit=N: dirty cached blocks before writeback */
+};
+static struct rufs_options rufs_opts = {
+	.disk_size = DEFAULT_DISK_SIZE,
+	.inodes = DEFAULT_INUM,
+};
+
+#define RUFS_OPT(t, p, v) { t, offsetof(struct rufs_options, p), v }
+static const struct fuse_opt rufs_opt_spec[] = {
+	RUFS_OPT("mmap", mmap, 1),
+	RUFS_OPT("uring", uring, 1),
+	RUFS_OPT("direct", direct, 1),
+	RUFS_OPT("disk_size=%s", size_str, 0),
+	RUFS_OPT("inodes=%u", inodes, 0),
+	RUFS_OPT("compact_dirs", compact_dirs, 1),
+	RUFS_OPT("extents", extents, 1),
+	RUFS_OPT("dirty_limit=%d", dirty_limit, 0),
+	FUSE_OPT_END
+};
+
 
 // Declare your in-memory data structures here
 
@@ -33,14 +74,27 @@ char diskfile_path[PATH_MAX];
 bitmap_t inodeBitmap;
 //Data Block Bitmap
 bitmap_t dataBlockBitmap;
+//One flag per bitmap block, set when that block has changes not yet on disk
+unsigned char *inodeBitmapDirty;
+unsigned char *dataBitmapDirty;
+//Allocation groups the bitmaps are split into (see "Allocation groups")
+struct alloc_group {
+	pthread_mutex_t lock;	/* guards this group's slice of both bitmaps */
+	int ino_first, ino_count;	/* inode numbers [ino_first, ino_first+ino_count) */
+	int blk_first, blk_count;	/* data blocks, relative to d_start_blk */
+	int ino_free, blk_free;
+	int ino_hint, blk_hint;	/* next-free hints, relative to the group start */
+};
+static struct alloc_group *groups;
+static int ngroups;
+//Data blocks promised to buffered writes but not allocated yet
+static int blocks_reserved = 0;
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
 //Super Block
 struct superblock* superBlock;
 
 //Starting Numbers of important blocks 
 int super_num = 0;
-int ino_bit_num = 1;
-int db_bit_num = 2;
-int ino_start = 3;
 int inodes_per_block = BLOCK_SIZE/sizeof(struct inode);
 int root_ino = 0;
 
@@ -62,607 +116,4309 @@ uint8_t get_bitmap(bitmap_t b, int i)
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
-/* 
- * Get available inode number from bitmap
+/*
+ * Free-bit search
+ *
+ * Bitmaps are scanned 64 bits at a time: a word that is not all ones holds
+ * a free bit, and count-trailing-zeros of its complement gives the index.
+ * On x86 an AVX2 scan that skips 256 bits per compare is picked at runtime.
  */
-int get_avail_ino() {
-	bitmap_t inodeBit = malloc(BLOCK_SIZE);
-	// Step 1: Read inode bitmap from disk
-	if(bio_read(ino_bit_num,inodeBit) < 0){
+static inline uint64_t bitmap_word(const unsigned char *b, int w)
+{
+	uint64_t v;
+	memcpy(&v, b + (size_t)w * 8, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
 
-		free(inodeBit);
-		printf("Inode Bitmap Read Error");
+//Index of the first clear bit in words [from, to), or -1
+static int bitmap_scan_words(const unsigned char *b, int from, int to)
+{
+	for(int w = from; w < to; w++){
+		uint64_t v = bitmap_word(b, w);
+		if(v != ~0ULL){
+			return w*64 + __builtin_ctzll(~v);
+		}
 	}
-	int num = -1;
-	// Step 2: Traverse inode bitmap to find an available slot
-	for(int i = 0; i< MAX_INUM/8;i++){
-		for(int j = 0; j<8;j++){
-			if(!(inodeBit[i] & (1 << j))){
-				num = i*8 + j;
-				set_bitmap(inodeBit,num);
-				break;
-			}
+	return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static int bitmap_scan_words_avx2(const unsigned char *b, int from, int to)
+{
+	const __m256i ones = _mm256_set1_epi8((char)0xFF);
+	int w = from;
+	for(; w + 4 <= to; w += 4){
+		__m256i v = _mm256_loadu_si256((const __m256i *)(b + (size_t)w * 8));
+		if((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) != 0xFFFFFFFFu){
+			return bitmap_scan_words(b, w, w + 4);
 		}
-		if(num != -1){
-				break;
-			}
 	}
+	return bitmap_scan_words(b, w, to);
+}
+#endif
 
-	bio_write(ino_bit_num,inodeBit);
-	free(inodeBit);
-	// Step 3: Update inode bitmap and write to disk 
+static int (*bitmap_scan)(const unsigned char *, int, int) = NULL;
 
-	return num;
+static void bitmap_scan_init()
+{
+	bitmap_scan = bitmap_scan_words;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		bitmap_scan = bitmap_scan_words_avx2;
+	}
+#endif
 }
 
-/* 
- * Get available data block number from bitmap
- */
-int get_avail_blkno() {
+//First clear bit in [from, nbits), or -1
+static int bitmap_next_zero(bitmap_t b, int nbits, int from)
+{
+	int nwords = (nbits + 63) / 64;
+	int w, num;
+	uint64_t v;
 
-	// Step 1: Read data block bitmap from disk
-	bitmap_t dataBit = malloc(BLOCK_SIZE);
+	if(from < 0 || from >= nbits){
+		return -1;
+	}
+	// Bits below from in its own word are treated as used
+	w = from / 64;
+	v = bitmap_word(b, w) | ((1ULL << (from & 63)) - 1);
+	if(v != ~0ULL){
+		num = w*64 + __builtin_ctzll(~v);
+	}else{
+		num = bitmap_scan(b, w + 1, nwords);
+	}
+	return (num >= 0 && num < nbits) ? num : -1;
+}
 
-	if(bio_read(db_bit_num,dataBit) < 0){
+//First set bit in [from, nbits), or nbits if the rest of the map is clear
+static int bitmap_next_one(bitmap_t b, int nbits, int from)
+{
+	int nwords = (nbits + 63) / 64;
+	int w = from / 64;
+	uint64_t v;
 
-		free(dataBit);
-		printf("Data Bitmap Read Error");
+	if(from >= nbits){
+		return nbits;
 	}
-	int num = -1;
+	v = bitmap_word(b, w) & ~((1ULL << (from & 63)) - 1);
+	while(v == 0 && ++w < nwords){
+		v = bitmap_word(b, w);
+	}
+	if(v == 0){
+		return nbits;
+	}
+	from = w*64 + __builtin_ctzll(v);
+	return from < nbits ? from : nbits;
+}
 
-	// Step 2: Traverse data block bitmap to find an available slot
-	for(int i = 0; i< MAX_DNUM/8;i++){
-		for(int j = 0; j<8;j++){
-			if(!(dataBit[i] & (1 << j))){
-				num = i*8 + j;
-				set_bitmap(dataBit,num);
-				break;
-			}
-		}
-		if(num != -1){
-				break;
-			}
+/*
+ * Find a clear bit among the first nbits of b, starting at hint and
+ * wrapping around to the beginning. Returns -1 if every bit is set.
+ */
+int bitmap_find_zero(bitmap_t b, int nbits, int hint)
+{
+	int num;
+
+	if(bitmap_scan == NULL){
+		bitmap_scan_init();
 	}
+	if(hint < 0 || hint >= nbits){
+		hint = 0;
+	}
+	num = bitmap_next_zero(b, nbits, hint);
+	if(num < 0 && hint > 0){
+		num = bitmap_next_zero(b, nbits, 0);
+	}
+	return num;
+}
 
-	bio_write(db_bit_num,dataBit);
+//Number of blocks each on-disk bitmap spans
+#define I_BITMAP_BLKS(sb)	((sb)->d_bitmap_blk - (sb)->i_bitmap_blk)
+#define D_BITMAP_BLKS(sb)	((sb)->i_start_blk - (sb)->d_bitmap_blk)
 
-	free(dataBit);
-	// Step 3: Update data block bitmap and write to disk 
+//Record that bit num changed so its bitmap block is written at the next flush
+//(neighbouring groups can share a bitmap block and mark it at the same time)
+static void bitmap_dirty(unsigned char *dirty, int num) {
+	__atomic_store_n(&dirty[num / (BLOCK_SIZE*8)], 1, __ATOMIC_RELAXED);
+}
 
-	return num;
+//Allocate zeroed in-memory bitmaps and dirty flags sized for superBlock
+static void bitmaps_alloc() {
+	int iblks = I_BITMAP_BLKS(superBlock);
+	int dblks = D_BITMAP_BLKS(superBlock);
+
+	inodeBitmap = (bitmap_t)calloc(iblks, BLOCK_SIZE);
+	dataBlockBitmap = (bitmap_t)calloc(dblks, BLOCK_SIZE);
+	inodeBitmapDirty = calloc(iblks, 1);
+	dataBitmapDirty = calloc(dblks, 1);
 }
 
-/* 
- * inode operations
+/*
+ * Allocation groups
+ *
+ * Both bitmaps are split into ngroups groups, each owning a range of inode
+ * numbers and a range of data blocks with its own lock, free counts and
+ * next-free hints, so threads allocating in different groups never wait on
+ * each other. Every range starts on a 64-bit boundary, which keeps the
+ * word-at-a-time scans inside their own group's bits.
+ * Each thread allocates blocks from its goal group first and spills into
+ * the following groups only when that one is full. alloc_near() points the
+ * goal at an inode's group, so a file's blocks stay next to its inode;
+ * threads that never set a goal are dealt groups round-robin.
  */
-int readi(uint16_t ino, struct inode *inode) {
+static int group_inodes, group_blks;
+static __thread int alloc_goal = -1;
+static int alloc_rotor = 0;
+
+//Number of set bits in [from, from+n) of b; from is a multiple of 64
+static int bitmap_weight(bitmap_t b, int from, int n) {
+	int w = from / 64, set = 0;
+	for(; n >= 64; n -= 64, w++){
+		set += __builtin_popcountll(bitmap_word(b, w));
+	}
+	if(n > 0){
+		set += __builtin_popcountll(bitmap_word(b, w) & ((1ULL << n) - 1));
+	}
+	return set;
+}
 
-  // Step 1: Get the inode's on-disk block number
-  if(ino > MAX_INUM){
-	printf("ERROR: Inode out of range");
-	return -1;
-  }
-	int block = ino/inodes_per_block;
-	block += ino_start;
-  // Step 2: Get offset of the inode in the inode on-disk block
-	uint16_t offset = (ino%inodes_per_block)*sizeof(struct inode);
-  // Step 3: Read the block from disk and then copy into inode structure
-    void* tmp = malloc(BLOCK_SIZE);
-	bio_read(block,tmp);
-	memcpy(inode, tmp+offset,sizeof(struct inode));
-	free(tmp);
-	return 0;
+static void groups_destroy() {
+	for(int g = 0; g < ngroups; g++){
+		pthread_mutex_destroy(&groups[g].lock);
+	}
+	free(groups);
+	groups = NULL;
+	ngroups = 0;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
+//Lay the groups over superBlock's geometry and count their free bits
+static void groups_init() {
+	groups_destroy();
+	blocks_reserved = 0;
+	if(bitmap_scan == NULL){
+		bitmap_scan_init();
+	}
+	group_inodes = superBlock->group_inodes;
+	group_blks = superBlock->group_blks;
+	// disks made before allocation groups are a single group
+	if(group_inodes == 0 || group_blks == 0){
+		group_inodes = (superBlock->max_inum + 63) & ~63;
+		group_blks = (superBlock->max_dnum + 63) & ~63;
+	}
+	ngroups = (superBlock->max_dnum + group_blks - 1) / group_blks;
+	groups = calloc(ngroups, sizeof(*groups));
+	for(int g = 0; g < ngroups; g++){
+		struct alloc_group *ag = &groups[g];
+		pthread_mutex_init(&ag->lock, NULL);
+		ag->ino_first = g * group_inodes;
+		ag->ino_count = (int)superBlock->max_inum - ag->ino_first;
+		if(ag->ino_count > group_inodes){
+			ag->ino_count = group_inodes;
+		}
+		if(ag->ino_count < 0){
+			ag->ino_first = superBlock->max_inum;
+			ag->ino_count = 0;
+		}
+		ag->blk_first = g * group_blks;
+		ag->blk_count = (int)superBlock->max_dnum - ag->blk_first;
+		if(ag->blk_count > group_blks){
+			ag->blk_count = group_blks;
+		}
+		ag->ino_free = ag->ino_count - bitmap_weight(inodeBitmap, ag->ino_first, ag->ino_count);
+		ag->blk_free = ag->blk_count - bitmap_weight(dataBlockBitmap, ag->blk_first, ag->blk_count);
+	}
+}
 
-	// Step 1: Get the block number where this inode resides on disk
-	if(ino > MAX_INUM){
-	printf("ERROR: Inode out of range");
-	return -1;
-  }
-	int block = ino/inodes_per_block;
-	block += ino_start;
-	// Step 2: Get the offset in the block where this inode resides on disk
-	uint16_t offset = (ino%inodes_per_block)*sizeof(struct inode);
-	// Step 3: Write inode to disk 
-	void* tmp = malloc(BLOCK_SIZE);
-	bio_read(block,tmp);
-	memcpy(tmp+offset, inode, sizeof(struct inode));
-	bio_write(block,tmp);
-	free(tmp);
-	return 0;
+//Group that owns inode ino
+static int ino_group(int ino) {
+	int g = ino / group_inodes;
+	return g < ngroups ? g : ngroups - 1;
 }
 
+//Group that owns data block num (relative to d_start_blk)
+static int blk_group(int num) {
+	return num / group_blks;
+}
 
 /* 
- * directory operations
+ * Allocate this thread's data blocks near inode ino from now on
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+void alloc_near(int ino) {
+	if(ino >= 0 && ino < (int)superBlock->max_inum){
+		alloc_goal = ino_group(ino);
+	}
+}
 
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-  struct inode *dir_inode = (struct inode*)malloc(sizeof(struct inode));
-  readi(ino, dir_inode);
-  // Step 2: Get data block of current directory from inode
-	int block;
-	void* buf = malloc(BLOCK_SIZE);
-	struct dirent *tmp = (struct dirent*)malloc(sizeof(struct dirent));
-  // Step 3: Read directory's data block and check each directory entry.
-  //If the name matches, then copy directory entry to dirent structure
+//Group this thread allocates from first
+static int goal_group() {
+	if(alloc_goal < 0 || alloc_goal >= ngroups){
+		alloc_goal = __atomic_fetch_add(&alloc_rotor, 1, __ATOMIC_RELAXED) % ngroups;
+	}
+	return alloc_goal;
+}
 
-  for(int b = 0; b<16; b++){
-	if(dir_inode->direct_ptr[b] == 0){
-		printf("ERROR: End of directory or empty dir");
-		free(buf);
-		free(tmp);
+/* 
+ * Load both bitmaps into memory; allocation works on these copies
+ */
+int bitmaps_load() {
+	if(inodeBitmap == NULL){
+		bitmaps_alloc();
+	}
+	if(bio_read_range(superBlock->i_bitmap_blk, I_BITMAP_BLKS(superBlock), inodeBitmap) < 0){
+		printf("Inode Bitmap Read Error");
 		return -1;
 	}
-
-	bio_read(block,buf);
-	for(int i = 0; i< BLOCK_SIZE/sizeof(dirent);i++){
-		memcpy(tmp,buf+(i*sizeof(struct dirent)),sizeof(struct dirent));
-		if(strcmp(tmp->name,fname)==0 && tmp->valid == 1){
-			memcpy(dirent,tmp,sizeof(struct dirent));
-			free(tmp);
-			free(buf);
-			free(dir_inode);
-			return 0;
-		}
+	if(bio_read_range(superBlock->d_bitmap_blk, D_BITMAP_BLKS(superBlock), dataBlockBitmap) < 0){
+		printf("Data Bitmap Read Error");
+		return -1;
 	}
-  }
-	free(tmp);
-	free(buf);
-	free(dir_inode);
-	return -1;
+	memset(inodeBitmapDirty, 0, I_BITMAP_BLKS(superBlock));
+	memset(dataBitmapDirty, 0, D_BITMAP_BLKS(superBlock));
+	groups_init();
+	return 0;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	int block;
-	void* buf = malloc(BLOCK_SIZE);
-	int free_ent = -1;
-
-	// Step 2: Check if fname (directory name) is already used in other entries
-	struct dirent *tmp = (struct dirent*)malloc(sizeof(struct dirent));
-	for(int b = 0; b<16;b++){
-		if(dir_inode.direct_ptr[b] == 0){
-		break;
+/* 
+ * Write back whichever in-memory bitmap blocks changed since the last flush
+ */
+int bitmaps_flush() {
+	int ret = 0;
+	// a bitmap block can hold several groups' bits, so hold them all
+	for(int g = 0; g < ngroups; g++){
+		pthread_mutex_lock(&groups[g].lock);
 	}
-		int block = dir_inode.direct_ptr[b];
-		bio_read(block,buf);
-	for(int i = 0; i< dir_inode.size/sizeof(struct dirent);i++){
-		memcpy(tmp,buf+(i*sizeof(struct dirent)),sizeof(struct dirent));
-		if(tmp->valid == 0){
-			free_ent = i;
+	for(int b = 0; b < I_BITMAP_BLKS(superBlock) && ret == 0; b++){
+		if(!inodeBitmapDirty[b]){
+			continue;
+		}
+		if(bio_write(superBlock->i_bitmap_blk + b, inodeBitmap + b*BLOCK_SIZE) < 0){
+			printf("Inode Bitmap Write Failed");
+			ret = -1;
 			break;
 		}
-		if(tmp->valid == 1 && strcmp(tmp->name,fname)==0 ){
-			perror("dir already exists!");
-			free(tmp);
-			free(buf);
-			return -1;
+		inodeBitmapDirty[b] = 0;
+	}
+	for(int b = 0; b < D_BITMAP_BLKS(superBlock) && ret == 0; b++){
+		if(!dataBitmapDirty[b]){
+			continue;
+		}
+		if(bio_write(superBlock->d_bitmap_blk + b, dataBlockBitmap + b*BLOCK_SIZE) < 0){
+			printf("Data Block Bitmap Write Failed");
+			ret = -1;
+			break;
 		}
+		dataBitmapDirty[b] = 0;
 	}
+	for(int g = ngroups - 1; g >= 0; g--){
+		pthread_mutex_unlock(&groups[g].lock);
 	}
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	struct dirent *dir_ent = (struct dirent*)malloc(sizeof(struct dirent));
-	dir_ent->ino = f_ino;
-	strcpy(dir_ent->name,fname);
-	dir_ent->len = name_len;
-	dir_ent->valid = 1;
+	return ret;
+}
 
-	// Allocate a new data block for this directory if it does not exist
-   if(free_ent == -1){
-		int block = get_avail_blkno();
-		if(block <0){
-			perror("block allocation failed!");
-		}else{
-			bio_read(block,buf);
-			for(int b = 0; b <16; b++){
-				if(dir_inode.direct_ptr[b] == 0){
-					dir_inode.direct_ptr[b] = block;
-					break;
-				}
-			}
-			free_ent = 0;
-		}
-   }
+//Take a free inode from group g, or -1 if it has none
+static int group_ino(int g) {
+	struct alloc_group *ag = &groups[g];
+	int num = -1;
 
-	// Update directory inode
-	//add something to edit inode modification time
-	dir_inode.size += sizeof(struct dirent);
-	dir_inode.link+= 1;
-	writei(dir_inode.ino,&dir_inode);
-	
-	// Write directory entry
-	memcpy(buf+(free_ent*sizeof(struct dirent)),dir_ent,sizeof(struct dirent));
-	bio_write(block,buf);
-	free(tmp);
-	free(dir_ent);
-	free(buf);
-	return 0;
+	pthread_mutex_lock(&ag->lock);
+	if(ag->ino_free > 0){
+		num = bitmap_find_zero(inodeBitmap + ag->ino_first/8, ag->ino_count, ag->ino_hint);
+	}
+	if(num >= 0){
+		ag->ino_hint = num + 1;
+		num += ag->ino_first;
+		set_bitmap(inodeBitmap,num);
+		bitmap_dirty(inodeBitmapDirty,num);
+		ag->ino_free--;
+	}
+	pthread_mutex_unlock(&ag->lock);
+	return num;
 }
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+//Take a free data block from group g (relative to d_start_blk), or -1
+static int group_blkno(int g) {
+	struct alloc_group *ag = &groups[g];
+	int num = -1;
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+	pthread_mutex_lock(&ag->lock);
+	if(ag->blk_free > 0){
+		num = bitmap_find_zero(dataBlockBitmap + ag->blk_first/8, ag->blk_count, ag->blk_hint);
+	}
+	if(num >= 0){
+		ag->blk_hint = num + 1;
+		num += ag->blk_first;
+		set_bitmap(dataBlockBitmap,num);
+		bitmap_dirty(dataBitmapDirty,num);
+		ag->blk_free--;
+	}
+	pthread_mutex_unlock(&ag->lock);
+	return num;
+}
 
-	int block;
-	void* buf = malloc(BLOCK_SIZE);
-	int entry_num = -1;
+/* 
+ * Get available inode number from bitmap
+ * A new file goes in its parent directory's group; parent_ino < 0 uses
+ * this thread's goal group. The bit reaches the disk at the next flush.
+ */
+int get_avail_ino_near(int parent_ino) {
+	int start;
 
-	// Step 2: Check if fname (directory name) is already used in other entries
-	struct dirent *tmp = (struct dirent*)malloc(sizeof(struct dirent));
-	for(int b = 0; b<16; b++){
-		if(dir_inode.direct_ptr[b] == 0){
-		break;
+	// Step 1: Pick the group to search first
+	if(parent_ino >= 0){
+		start = ino_group(parent_ino);
+	}else{
+		start = goal_group();
 	}
-		block = dir_inode.direct_ptr[b];
-		bio_read(block,buf);
-	for(int i = 0; i< dir_inode.size/sizeof(struct dirent);i++){
-		memcpy(tmp,buf+(i*sizeof(struct dirent)),sizeof(struct dirent));
-		if(tmp->valid == 1 && strcmp(tmp->name,fname)==0 ){
-			entry_num = i;
-			break;
+	// Step 2: Search it, then the groups after it
+	for(int i = 0; i < ngroups; i++){
+		int num = group_ino((start + i) % ngroups);
+		if(num >= 0){
+			return num;
 		}
 	}
-	if(entry_num != -1){
-		break;
-	}
-	}
-	// Step 2: Check if fname exist
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-	if(entry_num !=-1){
-		tmp->valid = 0;
-		memcpy(buf+(entry_num*sizeof(struct dirent)),tmp,sizeof(struct dirent));
-		bio_write(block,buf);
-		dir_inode.size -= sizeof(struct dirent);
-		dir_inode.link -=1;
-		//edit dir_inode mod time
-		writei(dir_inode.ino,&dir_inode);
-		free(tmp);
-		free(buf);
-		return 0;
-	}
-	printf("Entry Not Found!");
-	free(tmp);
-	free(buf);
 	return -1;
 }
 
+int get_avail_ino() {
+	return get_avail_ino_near(-1);
+}
+
 /* 
- * namei operation
+ * Get available data block number from bitmap
+ * Returns the absolute disk block number of the new block
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	if(path[0] == '\0'){
-		printf("ERROR: empty path!!");
-		return -1;
+int get_avail_blkno() {
+	// Search the goal group, then the groups after it
+	int start = goal_group();
+	for(int i = 0; i < ngroups; i++){
+		int num = group_blkno((start + i) % ngroups);
+		if(num >= 0){
+			return superBlock->d_start_blk + num;
+		}
 	}
-    char delim[] = "/"; // Delimiter to split the path
-	char *paths = (char *)malloc(sizeof(path));
-	char *saveptr;
-    char *token = strtok_r(paths, delim,&saveptr);
-
-	readi(root_ino,inode);
-	int foundFlag = 0;
-
-	//buffer to read the data blocks associated with inode
-	void* buf = malloc(BLOCK_SIZE);
-	//temporary to read directory entries from data blocks
-	struct dirent *tmp = (struct dirent*)malloc(sizeof(struct dirent));
-    while (token != NULL) {
-		foundFlag = 0;
-		//CODE TO SEARCH THROUGH ALL DATA BLOCKS OS THE INODE
+	return -1;
+}
 
-		for(int b = 0; b<16;b++){//loop to go through all data block pointers in inode
-			if(inode->direct_ptr[b] == 0){
-			printf("ERROR: file section not found");
-			free(tmp);
-			free(buf);
-			return -1;
-		}
-		
-		int block = inode->direct_ptr[b];
-		bio_read(block,buf);
-		for(int i = 0; i< inode->size/sizeof(struct dirent);i++){
-			memcpy(tmp,buf+(i*sizeof(struct dirent)),sizeof(struct dirent));
-			if(tmp->valid == 1 && strcmp(tmp->name,token)==0 ){//if name match, then reads that directory entires inode to inode structure being used
-				readi(tmp->ino,inode);
-				foundFlag = 1;
+/*
+ * Next-fit search of group g for a run of up to want free data blocks,
+ * starting at the group's hint; if no run is that long the longest one
+ * seen is taken, unless whole is set. Returns 0 and marks the run used.
+ */
+static int group_extent(int g, int want, int whole, int *start, int *len) {
+	struct alloc_group *ag = &groups[g];
+	bitmap_t map = dataBlockBitmap + ag->blk_first/8;
+	int n = ag->blk_count;
+	int best = -1, best_len = 0;
+	int hint, pos, wrapped = 0;
+
+	if(want > n){
+		want = n;
+	}
+	pthread_mutex_lock(&ag->lock);
+	if(ag->blk_free < (whole ? want : 1)){
+		pthread_mutex_unlock(&ag->lock);
+		return -1;
+	}
+	hint = ag->blk_hint;
+	if(hint < 0 || hint >= n){
+		hint = 0;
+	}
+	pos = hint;
+	// Step 1: Walk free runs from the hint, wrapping to the start once
+	for(;;){
+		int z = bitmap_next_zero(map, n, pos);
+		if(z < 0 || (wrapped && z >= hint)){
+			if(wrapped || hint == 0){
 				break;
 			}
+			wrapped = 1;
+			pos = 0;
+			continue;
 		}
-
-		if(foundFlag == 1){
-			free(tmp);
-			free(buf);
+		int end = bitmap_next_one(map, n, z);
+		if(end - z > want){
+			end = z + want;
+		}
+		if(end - z > best_len){
+			best = z;
+			best_len = end - z;
+		}
+		if(best_len == want){
 			break;
 		}
+		pos = end;
+	}
+	if(best == -1 || (whole && best_len < want)){
+		pthread_mutex_unlock(&ag->lock);
+		return -1;
+	}
+	// Step 2: Mark the run used; it reaches the disk at the next flush
+	for(int i = ag->blk_first + best; i < ag->blk_first + best + best_len; i++){
+		set_bitmap(dataBlockBitmap,i);
+		bitmap_dirty(dataBitmapDirty,i);
+	}
+	ag->blk_free -= best_len;
+	ag->blk_hint = best + best_len;
+	pthread_mutex_unlock(&ag->lock);
 
-		}
-        token = strtok_r(NULL, delim,&saveptr);
-    }
-	
+	*start = superBlock->d_start_blk + ag->blk_first + best;
+	*len = best_len;
 	return 0;
 }
+
 /* 
- * Make file system
+ * Get a run of up to want contiguous data blocks
+ * A run never crosses a group boundary. The goal group is tried first for
+ * a whole run of want blocks, then the other groups; failing that, the
+ * longest run in the first group with free space is used.
+ * On success *start is the absolute disk block of the run and *len its length.
  */
-int rufs_mkfs() {
-
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
-
-	// write superblock information
-	superBlock = malloc(sizeof(struct superblock));
-	superBlock->magic_num = MAGIC_NUM;
-	superBlock->max_dnum = MAX_DNUM;
-	superBlock->max_inum = MAX_INUM;
-	superBlock->i_bitmap_blk = 1;
-	superBlock->d_bitmap_blk = 2;
-	superBlock->i_start_blk = 3;
-	superBlock->d_start_blk = (MAX_INUM*sizeof(struct inode))/BLOCK_SIZE + 3;
+int get_avail_extent(int want, int *start, int *len) {
+	if(want < 1){
+		want = 1;
+	}
+	int first = goal_group();
+	for(int i = 0; i < ngroups; i++){
+		if(group_extent((first + i) % ngroups, want, 1, start, len) == 0){
+			return 0;
+		}
+	}
+	for(int i = 0; i < ngroups; i++){
+		if(group_extent((first + i) % ngroups, want, 0, start, len) == 0){
+			return 0;
+		}
+	}
+	return -1;
+}
 
-	if(bio_write(super_num, (void *)superBlock) < 0){
+//Free data blocks not yet promised to a reservation, with reserve_lock held
+static int blocks_avail() {
+	int avail = 0;
+	for(int g = 0; g < ngroups; g++){
+		pthread_mutex_lock(&groups[g].lock);
+		avail += groups[g].blk_free;
+		pthread_mutex_unlock(&groups[g].lock);
+	}
+	return avail - blocks_reserved;
+}
 
-		printf("SuperBlock Write Failed");
+/* 
+ * Set aside n data blocks for writes whose allocation is delayed
+ * Returns -1 if fewer than n free blocks are left unpromised
+ */
+int blocks_reserve(int n) {
+	pthread_mutex_lock(&reserve_lock);
+	if(blocks_avail() < n){
+		pthread_mutex_unlock(&reserve_lock);
+		return -1;
 	}
-	// initialize inode bitmap
-	int inoSize = (MAX_INUM/8);
-	inodeBitmap = (bitmap_t)malloc(inoSize*sizeof(unsigned char));
-	memset(inodeBitmap, 0, inoSize);
+	blocks_reserved += n;
+	pthread_mutex_unlock(&reserve_lock);
+	return 0;
+}
+
+void blocks_unreserve(int n) {
+	pthread_mutex_lock(&reserve_lock);
+	blocks_reserved -= n;
+	pthread_mutex_unlock(&reserve_lock);
+}
 
-	if(bio_write(ino_bit_num,(void *)inodeBitmap) < 0){
+/* 
+ * Data blocks free for new writes
+ */
+int blocks_free() {
+	pthread_mutex_lock(&reserve_lock);
+	int n = blocks_avail();
+	pthread_mutex_unlock(&reserve_lock);
+	return n;
+}
 
-		printf("Inode Bitmap Write Failed");
+/* 
+ * Return an inode number to the in-memory inode bitmap
+ */
+void free_ino(int ino) {
+	struct alloc_group *ag = &groups[ino_group(ino)];
+	pthread_mutex_lock(&ag->lock);
+	if(get_bitmap(inodeBitmap,ino)){
+		unset_bitmap(inodeBitmap,ino);
+		bitmap_dirty(inodeBitmapDirty,ino);
+		ag->ino_free++;
 	}
-	// initialize data block bitmap
-	int dbSize = (MAX_DNUM/8);
-	dataBlockBitmap = (bitmap_t)malloc(dbSize*sizeof(unsigned char));
-	memset(dataBlockBitmap, 0, dbSize);
+	pthread_mutex_unlock(&ag->lock);
+	// the number may be reused, so nothing cached under it stays valid
+	dcache_purge(ino);
+}
 
-	if(bio_write(db_bit_num,(void *)dataBlockBitmap) < 0){
-		printf("Data Block Bitmap Write Failed");
+/* 
+ * Return a disk block (as returned by get_avail_blkno) to the data bitmap
+ */
+void free_blkno(int blkno) {
+	int num = blkno - superBlock->d_start_blk;
+	struct alloc_group *ag = &groups[blk_group(num)];
+	pthread_mutex_lock(&ag->lock);
+	if(get_bitmap(dataBlockBitmap,num)){
+		unset_bitmap(dataBlockBitmap,num);
+		bitmap_dirty(dataBitmapDirty,num);
+		ag->blk_free++;
 	}
-	printf("all writes successes!");
-	// initialize root directory
-	struct inode *root = (struct inode*)malloc(sizeof(struct inode));
-	root->ino = root_ino;
-	root->valid = 1;
-	root->size = BLOCK_SIZE;
-	root->type = DIR_TYPE;
-	root->link = 2;
+	pthread_mutex_unlock(&ag->lock);
+}
 
-	int block = get_avail_blkno();
-	void* dirBlock = malloc(BLOCK_SIZE);
-	bio_read(block,dirBlock);
-	root->direct_ptr[0] = block;
+/* 
+ * inode operations
+ */
 
+//Read an inode straight from its inode-table block
+static int inode_load(uint16_t ino, struct inode *inode) {
 
+  // Step 1: Get the inode's on-disk block number
+	int block = ino/inodes_per_block;
+	block += superBlock->i_start_blk;
+  // Step 2: Get offset of the inode in the inode on-disk block
+	uint16_t offset = (ino%inodes_per_block)*sizeof(struct inode);
+  // Step 3: Read the block from disk and then copy into inode structure
+  // (with the mmap backend the inode is copied straight out of the mapping)
+	const void* mapped = bio_map(block);
+	if(mapped != NULL){
+		memcpy(inode, mapped+offset,sizeof(struct inode));
+		return 0;
+	}
+    void* tmp = bio_alloc();
+	bio_read(block,tmp);
+	memcpy(inode, tmp+offset,sizeof(struct inode));
+	bio_free(tmp);
+	return 0;
+}
 
-//SET UP ROOT DIRECTORY ENTRIES NEEDED HERE
+//Write an inode straight into its inode-table block
+static int inode_store(uint16_t ino, struct inode *inode) {
+	int block = ino/inodes_per_block + superBlock->i_start_blk;
+	uint16_t offset = (ino%inodes_per_block)*sizeof(struct inode);
+	void* tmp = bio_alloc();
+	bio_read(block,tmp);
+	memcpy(tmp+offset, inode, sizeof(struct inode));
+	bio_write(block,tmp);
+	bio_free(tmp);
+	return 0;
+}
 
-	dir_add(*root, root_ino, ".", 1);
-	dir_add(*root, root_ino, "..", 2);
+/*
+ * Inode cache
+ *
+ * Inodes are kept in memory, hashed by inode number and reference counted.
+ * iget() pins an inode (open files and the inodes along a path walk stay
+ * pinned) and iput() unpins it; only unpinned inodes are evicted. writei()
+ * just updates the cached copy, and dirty inodes are written back a whole
+ * inode-table block at a time.
+ * icache_lock guards the cache itself. Each entry also carries a
+ * reader/writer lock for the file or directory it holds (ilock/iunlock),
+ * which may only be taken while the inode is pinned.
+ */
+#define ICACHE_SIZE	512
+#define ICACHE_HASH	1024
+
+//A file block written but not yet on disk (see "Delayed allocation")
+struct wpage {
+	int lb;							/* logical block in the file */
+	int reserved;					/* no data block yet, one is reserved for it */
+	char *data;						/* BLOCK_SIZE bytes from bio_alloc */
+};
 
-	// update bitmap information for root directory
-	bitmap_t inodeBit = malloc(BLOCK_SIZE);
-	bitmap_t dbBit = malloc(BLOCK_SIZE);
+//Dirty pages of one inode, sorted by logical block; guarded by the inode lock
+struct wbuf {
+	struct wpage *pages;
+	int count;
+	int cap;
+	int meta;						/* blocks reserved for the map blocks writeback may need */
+};
 
-	bio_read(ino_bit_num,inodeBit);
-	bio_read(db_bit_num,dbBit);
+struct icache_entry {
+	struct inode inode;				/* cached inode, must stay first */
+	int ino;						/* inode number, -1 if unused */
+	int refcnt;						/* pins held by open files and path walks */
+	int dirty;						/* cached copy newer than the disk */
+	int ref;						/* CLOCK reference bit */
+	struct icache_entry *hnext;		/* next entry in the same hash chain */
+	pthread_rwlock_t lock;			/* ilock(): readers share, writers exclusive */
+	struct wbuf wb;					/* buffered writes */
+	int wb_pinned;					/* wb holds pages and a pin on the entry */
+	int nopen;						/* open handles; guarded by the inode lock */
+};
 
-	set_bitmap(inodeBit,0);
-	set_bitmap(dbBit,block);
+static struct icache_entry icache[ICACHE_SIZE];
+static struct icache_entry *icache_hash[ICACHE_HASH];
+static int icache_hand = 0;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+//Bumped whenever an inode-table block is written (icache_lock held)
+static unsigned int icache_table_gen = 0;
+
+static void icache_init() {
+	static int locks_ready = 0;
+	if(!locks_ready){
+		// a steady stream of readers must not hold a writer off forever
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		for(int i = 0; i < ICACHE_SIZE; i++){
+			pthread_rwlock_init(&icache[i].lock, &attr);
+		}
+		pthread_rwlockattr_destroy(&attr);
+		locks_ready = 1;
+	}
+	for(int i = 0; i < ICACHE_SIZE; i++){
+		icache[i].ino = -1;
+		icache[i].refcnt = 0;
+		icache[i].dirty = 0;
+		icache[i].ref = 0;
+		icache[i].hnext = NULL;
+		icache[i].wb_pinned = 0;
+		icache[i].nopen = 0;
+		memset(&icache[i].wb, 0, sizeof(icache[i].wb));
+	}
+	memset(icache_hash, 0, sizeof(icache_hash));
+	icache_hand = 0;
+}
 
-	bio_write(ino_bit_num,inodeBit);
-	bio_write(db_bit_num,dbBit);
+static struct icache_entry **icache_bucket(int ino) {
+	return &icache_hash[ino & (ICACHE_HASH - 1)];
+}
 
-	free(inodeBit);
-	free(dbBit);
-	// update inode for root directory
-	writei(root->ino,root);
-	free(root);
-	free(dirBlock);
-	return 0;
+static struct icache_entry *icache_lookup(int ino) {
+	struct icache_entry *e = *icache_bucket(ino);
+	while(e != NULL && e->ino != ino){
+		e = e->hnext;
+	}
+	return e;
 }
 
+/*
+ * Write every dirty cached inode that lives in inode-table block blk
+ * with one read-modify-write of that block (icache_lock held). An inode
+ * is only copied under its read lock, so one a writer is part way through
+ * changing stays dirty for a later writeback; held is an entry whose lock
+ * the caller already has.
+ */
+static int icache_writeback_block(int blk, struct icache_entry *held) {
+	int first = blk*inodes_per_block;
+	void *tmp = NULL;
+
+	for(int ino = first; ino < first + inodes_per_block && ino < superBlock->max_inum; ino++){
+		struct icache_entry *e = icache_lookup(ino);
+		if(e == NULL || !e->dirty){
+			continue;
+		}
+		// icache_lock is taken with inode locks held, so never wait here
+		if(e != held && pthread_rwlock_tryrdlock(&e->lock) != 0){
+			continue;
+		}
+		if(tmp == NULL){
+			tmp = bio_alloc();
+			bio_read(superBlock->i_start_blk + blk, tmp);
+		}
+		memcpy(tmp + (ino - first)*sizeof(struct inode), &e->inode, sizeof(struct inode));
+		e->dirty = 0;
+		if(e != held){
+			pthread_rwlock_unlock(&e->lock);
+		}
+	}
+	if(tmp == NULL){
+		return 0;
+	}
+	int ret = bio_write(superBlock->i_start_blk + blk, tmp);
+	bio_free(tmp);
+	icache_table_gen++;
+	return ret < 0 ? -1 : 0;
+}
 
 /* 
- * FUSE file operations
+ * Write back all dirty inodes, grouped by inode-table block
  */
-static void *rufs_init(struct fuse_conn_info *conn) {
+int icache_flush() {
+	int ret = 0;
+	pthread_mutex_lock(&icache_lock);
+	for(int i = 0; i < ICACHE_SIZE; i++){
+		struct icache_entry *e = &icache[i];
+		if(e->ino < 0 || !e->dirty){
+			continue;
+		}
+		// Pin it and wait for its read lock without icache_lock, so a
+		// writer part way through finishes before it is written
+		e->refcnt++;
+		pthread_mutex_unlock(&icache_lock);
+		pthread_rwlock_rdlock(&e->lock);
+		pthread_mutex_lock(&icache_lock);
+		if(icache_writeback_block(e->ino/inodes_per_block, e) < 0){
+			ret = -1;
+		}
+		pthread_rwlock_unlock(&e->lock);
+		e->refcnt--;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return ret;
+}
 
-	// Step 1a: If disk file is not found, call mkfs
-	int fd = open(diskfile_path, O_RDWR);
-	if(fd < 0){
-		rufs_mkfs();
-	}else{
-		//1b
-		if(bio_read(0,superBlock) != 0){
-			printf("Super Block could not be read!");
-		//Data Structures Here
+//Find an unpinned entry with CLOCK, write it back if needed and unhash it
+static struct icache_entry *icache_evict() {
+	for(int scanned = 0; scanned < 2*ICACHE_SIZE; scanned++){
+		struct icache_entry *e = &icache[icache_hand];
+		icache_hand = (icache_hand + 1) % ICACHE_SIZE;
+		if(e->ino < 0){
+			return e;
+		}
+		if(e->refcnt > 0){
+			continue;
+		}
+		if(e->ref){
+			e->ref = 0;
+			continue;
+		}
+		if(e->dirty && (icache_writeback_block(e->ino/inodes_per_block, NULL) < 0 || e->dirty)){
+			continue;
+		}
+		struct icache_entry **pp = icache_bucket(e->ino);
+		while(*pp != e){
+			pp = &(*pp)->hnext;
+		}
+		*pp = e->hnext;
+		e->ino = -1;
+		return e;
 	}
+	return NULL;
+}
+
+//iget() with icache_lock held
+static struct inode *iget_locked(uint16_t ino) {
+	struct icache_entry *e;
 
+	if(ino >= superBlock->max_inum){
+		printf("ERROR: Inode out of range");
+		return NULL;
 	}
+	e = icache_lookup(ino);
+	if(e == NULL){
+		e = icache_evict();
+		if(e == NULL){
+			return NULL;
+		}
+		inode_load(ino, &e->inode);
+		e->ino = ino;
+		e->dirty = 0;
+		e->hnext = *icache_bucket(ino);
+		*icache_bucket(ino) = e;
+	}
+	e->refcnt++;
+	e->ref = 1;
+	return &e->inode;
+}
 
-  // Step 1b: If disk file is found, just initialize in-memory data structures
-  // and read superblock from disk
+/* 
+ * Get a pinned, cached copy of inode ino; release it with iput()
+ * Returns NULL if ino is out of range or every cache entry is pinned
+ */
+struct inode *iget(uint16_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct inode *ip = iget_locked(ino);
+	pthread_mutex_unlock(&icache_lock);
+	return ip;
+}
 
-	return NULL;
+void iput(struct inode *inode) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	pthread_mutex_lock(&icache_lock);
+	if(e != NULL && e->refcnt > 0){
+		e->refcnt--;
+	}
+	pthread_mutex_unlock(&icache_lock);
 }
 
-static void rufs_destroy(void *userdata) {
+//Mark a pinned inode as changed; it is written back at the next flush
+void idirty(struct inode *inode) {
+	pthread_mutex_lock(&icache_lock);
+	((struct icache_entry *)inode)->dirty = 1;
+	pthread_mutex_unlock(&icache_lock);
+}
 
-	// Step 1: De-allocate in-memory data structures
+//Lock a pinned inode's contents, shared for readers or exclusive for writers
+void ilock(struct inode *inode, int write) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	if(write){
+		pthread_rwlock_wrlock(&e->lock);
+	}else{
+		pthread_rwlock_rdlock(&e->lock);
+	}
+}
 
-	// Step 2: Close diskfile
+void iunlock(struct inode *inode) {
+	pthread_rwlock_unlock(&((struct icache_entry *)inode)->lock);
+}
 
+//Write buffer of a pinned inode; use it with the inode locked
+static struct wbuf *iwbuf(struct inode *inode) {
+	return &((struct icache_entry *)inode)->wb;
 }
 
-static int rufs_getattr(const char *path, struct stat *stbuf) {
+//Keep an inode cached while its write buffer holds pages (pin = 1), or stop
+static void iwbuf_pin(struct inode *inode, int pin) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	pthread_mutex_lock(&icache_lock);
+	e->refcnt += pin ? 1 : -1;
+	e->wb_pinned = pin;
+	pthread_mutex_unlock(&icache_lock);
+}
 
-	// Step 1: call get_node_by_path() to get inode from path
+//Index of the first buffered page at or after logical block lb
+static int wbuf_search(struct wbuf *wb, int lb) {
+	int lo = 0, hi = wb->count;
+	while(lo < hi){
+		int mid = (lo + hi)/2;
+		if(wb->pages[mid].lb < lb){
+			lo = mid + 1;
+		}else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-	// Step 2: fill attribute of file into stbuf from inode
+static struct wpage *wbuf_find(struct wbuf *wb, int lb) {
+	int i = wbuf_search(wb, lb);
+	return (i < wb->count && wb->pages[i].lb == lb) ? &wb->pages[i] : NULL;
+}
 
-		stbuf->st_mode   = S_IFDIR | 0755;
-		stbuf->st_nlink  = 2;
-		time(&stbuf->st_mtime);
+//Give the write buffer of ip a page for lb, which it must not have yet
+static struct wpage *wbuf_add(struct inode *ip, int lb) {
+	struct wbuf *wb = iwbuf(ip);
+	if(wb->count == wb->cap){
+		int cap = wb->cap ? wb->cap*2 : 16;
+		struct wpage *pages = realloc(wb->pages, cap*sizeof(*pages));
+		if(pages == NULL){
+			return NULL;
+		}
+		wb->pages = pages;
+		wb->cap = cap;
+	}
+	if(wb->count == 0){
+		iwbuf_pin(ip, 1);
+	}
+	int i = wbuf_search(wb, lb);
+	memmove(&wb->pages[i + 1], &wb->pages[i], (wb->count - i)*sizeof(*wb->pages));
+	wb->count++;
+	wb->pages[i].lb = lb;
+	wb->pages[i].reserved = 0;
+	wb->pages[i].data = bio_alloc();
+	return &wb->pages[i];
+}
 
-	return 0;
+//Drop every page in the write buffer of ip
+static void wbuf_clear(struct inode *ip) {
+	struct wbuf *wb = iwbuf(ip);
+	int had = wb->count;
+	for(int i = 0; i < wb->count; i++){
+		bio_free(wb->pages[i].data);
+	}
+	free(wb->pages);
+	wb->pages = NULL;
+	wb->count = 0;
+	wb->cap = 0;
+	blocks_unreserve(wb->meta);
+	wb->meta = 0;
+	if(had){
+		iwbuf_pin(ip, 0);
+	}
 }
 
-static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+//Drop the pages of logical blocks first..last, giving back their reservations
+static void wbuf_drop(struct inode *ip, int first, int last) {
+	struct wbuf *wb = iwbuf(ip);
+	int i = wbuf_search(wb, first), j = i, unreserve = 0;
+	while(j < wb->count && wb->pages[j].lb <= last){
+		unreserve += wb->pages[j].reserved;
+		bio_free(wb->pages[j].data);
+		j++;
+	}
+	if(j == i){
+		return;
+	}
+	memmove(&wb->pages[i], &wb->pages[j], (wb->count - j)*sizeof(*wb->pages));
+	wb->count -= j - i;
+	blocks_unreserve(unreserve);
+	if(wb->count == 0){
+		free(wb->pages);
+		wb->pages = NULL;
+		wb->cap = 0;
+		iwbuf_pin(ip, 0);
+	}
+}
 
-	// Step 1: Call get_node_by_path() to get inode from path
+int readi(uint16_t ino, struct inode *inode) {
+	int ret = 0;
+	pthread_mutex_lock(&icache_lock);
+	struct inode *ip = iget_locked(ino);
+	if(ip != NULL){
+		memcpy(inode, ip, sizeof(struct inode));
+		((struct icache_entry *)ip)->refcnt--;
+	}else if(ino >= superBlock->max_inum){
+		ret = -1;
+	}else{
+		ret = inode_load(ino, inode);
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return ret;
+}
 
-	// Step 2: If not find, return -1
+/*
+ * readi() for n inodes at once, as a directory listing needs them: cached
+ * inodes are copied and the inode-table blocks holding the others are
+ * read, without icache_lock, with one vectored read per run of adjacent
+ * blocks. Inodes read this way only go into free inode cache entries, so
+ * a big listing does not push out the inodes in use.
+ */
+int readi_many(int n, const uint16_t *inos, struct inode *inodes) {
+	if(n <= 0){
+		return 0;
+	}
+	int blks[n], nblks = 0, ret = 0;
+	char cached[n];
+	void *bufs[n];
+
+	pthread_mutex_lock(&icache_lock);
+	// Step 1: Copy cached inodes and collect the table blocks of the rest
+	for(int i = 0; i < n; i++){
+		struct icache_entry *e = NULL;
+		cached[i] = 1;
+		if(inos[i] >= superBlock->max_inum){
+			memset(&inodes[i], 0, sizeof(struct inode));
+			ret = -1;
+			continue;
+		}
+		if((e = icache_lookup(inos[i])) != NULL){
+			memcpy(&inodes[i], &e->inode, sizeof(struct inode));
+			continue;
+		}
+		cached[i] = 0;
+		// keep blks sorted and free of duplicates
+		int blk = inos[i]/inodes_per_block, k = nblks;
+		while(k > 0 && blks[k - 1] > blk){
+			k--;
+		}
+		if(k > 0 && blks[k - 1] == blk){
+			continue;
+		}
+		memmove(&blks[k + 1], &blks[k], (nblks - k)*sizeof(int));
+		blks[k] = blk;
+		nblks++;
+	}
+	unsigned int gen = icache_table_gen;
+	pthread_mutex_unlock(&icache_lock);
 
-    return 0;
+	// Step 2: Read each run of adjacent table blocks at once
+	for(int k = 0; k < nblks; k++){
+		bufs[k] = bio_alloc();
+	}
+	for(int k = 0; k < nblks; ){
+		int len = 1;
+		while(k + len < nblks && blks[k + len] == blks[k] + len){
+			len++;
+		}
+		if(bio_readv(superBlock->i_start_blk + blks[k], len, bufs + k) < 0){
+			ret = -1;
+		}
+		k += len;
+	}
+
+	// Step 3: Copy the other inodes out of their blocks, unless one got
+	// cached meanwhile, and cache them in free entries; if the table was
+	// written while the lock was dropped the blocks may be stale, so then
+	// nothing is cached
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *spare[n];
+	int nspare = 0;
+	for(int j = 0; j < ICACHE_SIZE && nspare < n && gen == icache_table_gen; j++){
+		if(icache[j].ino < 0){
+			spare[nspare++] = &icache[j];
+		}
+	}
+	for(int i = 0; i < n; i++){
+		if(cached[i]){
+			continue;
+		}
+		struct icache_entry *e = icache_lookup(inos[i]);
+		if(e != NULL){
+			memcpy(&inodes[i], &e->inode, sizeof(struct inode));
+			continue;
+		}
+		int k = 0;
+		while(blks[k] != inos[i]/inodes_per_block){
+			k++;
+		}
+		memcpy(&inodes[i], (char *)bufs[k] + (inos[i]%inodes_per_block)*sizeof(struct inode), sizeof(struct inode));
+		if(nspare > 0){
+			e = spare[--nspare];
+			memcpy(&e->inode, &inodes[i], sizeof(struct inode));
+			e->ino = inos[i];
+			e->dirty = 0;
+			e->ref = 0;
+			e->hnext = *icache_bucket(inos[i]);
+			*icache_bucket(inos[i]) = e;
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	for(int k = 0; k < nblks; k++){
+		bio_free(bufs[k]);
+	}
+	return ret;
 }
 
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+int writei(uint16_t ino, struct inode *inode) {
+	int ret = 0;
+	pthread_mutex_lock(&icache_lock);
+	struct inode *ip = iget_locked(ino);
+	if(ip != NULL){
+		memcpy(ip, inode, sizeof(struct inode));
+		((struct icache_entry *)ip)->dirty = 1;
+		((struct icache_entry *)ip)->refcnt--;
+	}else if(ino >= superBlock->max_inum){
+		ret = -1;
+	}else{
+		ret = inode_store(ino, inode);
+		icache_table_gen++;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return ret;
+}
 
-	// Step 1: Call get_node_by_path() to get inode from path
 
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
+/*
+ * Directory entry cache
+ *
+ * Maps (parent inode, name) to the child's inode number so path walks do
+ * not rescan directory blocks. Misses are cached too, as negative entries.
+ * dir_add/dir_remove keep the cache in step with the directories, and
+ * freeing an inode drops every entry cached under it. Entries are only
+ * made with the directory's inode lock held (dir_find() caches what it
+ * found under the shared lock), so a lookup cannot cache a result that a
+ * dir_add or dir_remove has made stale in the meantime. dcache_lock
+ * guards the whole cache.
+ */
+#define DCACHE_SIZE		1024
+#define DCACHE_HASH		2048
+#define DCACHE_NEG		-2			/* dcache_lookup: name known not to exist */
+
+struct dcache_entry {
+	int parent;						/* directory inode, -1 if unused */
+	int ino;						/* child inode, -1 for a negative entry */
+	uint32_t hash;					/* name_hash() of parent and name */
+	int ref;						/* CLOCK reference bit */
+	struct dcache_entry *hnext;		/* next entry in the same hash chain */
+	uint16_t len;					/* length of name */
+	char name[208];					/* same limit as struct dirent */
+};
 
-	return 0;
+static struct dcache_entry dcache[DCACHE_SIZE];
+static struct dcache_entry *dcache_hash[DCACHE_HASH];
+static int dcache_hand = 0;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//FNV-1a hash of a name, seeded so the same name hashes differently per directory
+static uint32_t name_hash(uint32_t seed, const char *name, size_t len) {
+	uint32_t h = 2166136261u ^ seed;
+	for(size_t i = 0; i < len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
 }
 
+static void dcache_init() {
+	for(int i = 0; i < DCACHE_SIZE; i++){
+		dcache[i].parent = -1;
+		dcache[i].hnext = NULL;
+		dcache[i].ref = 0;
+	}
+	memset(dcache_hash, 0, sizeof(dcache_hash));
+	dcache_hand = 0;
+}
 
-static int rufs_mkdir(const char *path, mode_t mode) {
+static struct dcache_entry *dcache_find(uint16_t parent, const char *name, size_t len, uint32_t h) {
+	struct dcache_entry *e = dcache_hash[h & (DCACHE_HASH - 1)];
+	while(e != NULL && !(e->hash == h && e->parent == parent && e->len == len &&
+			memcmp(e->name, name, len) == 0)){
+		e = e->hnext;
+	}
+	return e;
+}
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+static void dcache_unhash(struct dcache_entry *e) {
+	struct dcache_entry **pp = &dcache_hash[e->hash & (DCACHE_HASH - 1)];
+	while(*pp != e){
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	e->parent = -1;
+}
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
+/* 
+ * Look name up in directory parent
+ * Returns the child inode, DCACHE_NEG for a cached miss, or -1 if unknown
+ */
+int dcache_lookup(uint16_t parent, const char *name, size_t len) {
+	int ret = -1;
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_find(parent, name, len, name_hash(parent, name, len));
+	if(e != NULL){
+		e->ref = 1;
+		ret = e->ino < 0 ? DCACHE_NEG : e->ino;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return ret;
+}
 
-	// Step 3: Call get_avail_ino() to get an available inode number
+//Remember that name in parent is inode ino (-1 records that it does not exist)
+void dcache_insert(uint16_t parent, const char *name, size_t len, int ino) {
+	uint32_t h = name_hash(parent, name, len);
+	struct dcache_entry *e;
 
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
+	if(len > sizeof(e->name)){
+		return;
+	}
+	pthread_mutex_lock(&dcache_lock);
+	e = dcache_find(parent, name, len, h);
+	if(e == NULL){
+		// CLOCK: skip recently used entries once
+		for(;;){
+			e = &dcache[dcache_hand];
+			dcache_hand = (dcache_hand + 1) % DCACHE_SIZE;
+			if(e->parent < 0){
+				break;
+			}
+			if(e->ref){
+				e->ref = 0;
+				continue;
+			}
+			dcache_unhash(e);
+			break;
+		}
+		e->parent = parent;
+		e->hash = h;
+		e->len = len;
+		memcpy(e->name, name, len);
+		e->hnext = dcache_hash[h & (DCACHE_HASH - 1)];
+		dcache_hash[h & (DCACHE_HASH - 1)] = e;
+	}
+	e->ino = ino;
+	e->ref = 1;
+	pthread_mutex_unlock(&dcache_lock);
+}
 
-	// Step 5: Update inode for target directory
+//Drop every entry cached under directory parent
+void dcache_purge(uint16_t parent) {
+	pthread_mutex_lock(&dcache_lock);
+	for(int i = 0; i < DCACHE_SIZE; i++){
+		if(dcache[i].parent == parent){
+			dcache_unhash(&dcache[i]);
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
 
-	// Step 6: Call writei() to write inode to disk
-	
+/* 
+ * directory operations
+ */
+/*
+ * Directory block formats
+ *
+ * Entries in a linear directory block or a hash bucket use one of two
+ * layouts, picked at mkfs time. The default is an array of fixed-size
+ * struct dirent slots (valid == 0 marks a free slot). With
+ * FEATURE_COMPACT_DIRENT they are struct dirent_rec records sized to
+ * their names, kept contiguous from the start of the area: removing one
+ * slides the rest down, so free space is always a zeroed tail.
+ * The dblk_* helpers work on either layout; a position is a slot index
+ * for fixed entries and a byte offset for compact ones.
+ */
+#define DIRENT_REC_LEN(len)	((offsetof(struct dirent_rec, name) + (len) + 3) & ~3u)
+#define DIRENT_REC_HDR		offsetof(struct dirent_rec, name)
+
+static int dblk_compact(void) {
+	return superBlock->features & FEATURE_COMPACT_DIRENT;
+}
+
+//Bytes an entry for a name_len byte name takes up
+static size_t dblk_entry_size(size_t name_len) {
+	return dblk_compact() ? DIRENT_REC_LEN(name_len) : sizeof(struct dirent);
+}
+
+//End of the packed compact records in area
+static size_t dblk_used(const void *area, size_t area_len) {
+	size_t pos = 0;
+	while(pos + DIRENT_REC_HDR <= area_len){
+		const struct dirent_rec *r = area + pos;
+		if(r->rec_len == 0){
+			break;
+		}
+		pos += r->rec_len;
+	}
+	return pos;
+}
 
+/*
+ * Copy the next entry at or after *pos into out; *at gets its position and
+ * *pos moves past it. Returns 0 once the area has no more entries.
+ */
+static int dblk_next(const void *area, size_t area_len, int *pos, int *at, struct dirent *out) {
+	if(dblk_compact()){
+		if(*pos + DIRENT_REC_HDR > area_len){
+			return 0;
+		}
+		const struct dirent_rec *r = area + *pos;
+		if(r->rec_len == 0){
+			return 0;
+		}
+		out->ino = r->ino;
+		out->valid = 1;
+		out->len = r->name_len;
+		memcpy(out->name, r->name, r->name_len);
+		out->name[r->name_len] = '\0';
+		*at = *pos;
+		*pos += r->rec_len;
+		return 1;
+	}
+	while((*pos + 1)*sizeof(struct dirent) <= area_len){
+		memcpy(out, area + *pos*sizeof(struct dirent), sizeof(struct dirent));
+		*at = (*pos)++;
+		if(out->valid == 1){
+			return 1;
+		}
+	}
 	return 0;
 }
 
-static int rufs_rmdir(const char *path) {
+//Position of name in area (its entry copied to out if non-NULL), or -1
+static int dblk_find(const void *area, size_t area_len, const char *fname, size_t name_len, struct dirent *out) {
+	struct dirent ent;
+	int pos = 0, at;
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	while(dblk_next(area, area_len, &pos, &at, &ent)){
+		if(ent.len == name_len && memcmp(ent.name, fname, name_len) == 0){
+			if(out != NULL){
+				memcpy(out, &ent, sizeof(struct dirent));
+			}
+			return at;
+		}
+	}
+	return -1;
+}
 
-	// Step 2: Call get_node_by_path() to get inode of target directory
+//Whether an entry for a name_len byte name still fits in area
+static int dblk_fits(const void *area, size_t area_len, size_t name_len) {
+	if(dblk_compact()){
+		return dblk_used(area, area_len) + DIRENT_REC_LEN(name_len) <= area_len;
+	}
+	for(int i = 0; (i + 1)*sizeof(struct dirent) <= area_len; i++){
+		const struct dirent *d = area + i*sizeof(struct dirent);
+		if(d->valid != 1){
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	// Step 3: Clear data block bitmap of target directory
+//Add an entry to area; -1 if it is full
+static int dblk_insert(void *area, size_t area_len, uint16_t f_ino, const char *fname, size_t name_len) {
+	if(dblk_compact()){
+		size_t end = dblk_used(area, area_len);
+		size_t rec_len = DIRENT_REC_LEN(name_len);
+		if(end + rec_len > area_len){
+			return -1;
+		}
+		struct dirent_rec *r = area + end;
+		memset(r, 0, rec_len);
+		r->ino = f_ino;
+		r->rec_len = rec_len;
+		r->name_len = name_len;
+		memcpy(r->name, fname, name_len);
+		return 0;
+	}
+	for(int i = 0; (i + 1)*sizeof(struct dirent) <= area_len; i++){
+		struct dirent *d = area + i*sizeof(struct dirent);
+		if(d->valid != 1){
+			memset(d, 0, sizeof(struct dirent));
+			d->ino = f_ino;
+			d->valid = 1;
+			memcpy(d->name, fname, name_len);
+			d->len = name_len;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+//Drop the entry at position at (from dblk_find), compacting the block
+static void dblk_remove(void *area, size_t area_len, int at) {
+	if(dblk_compact()){
+		struct dirent_rec *r = area + at;
+		size_t rec_len = r->rec_len;
+		size_t end = dblk_used(area, area_len);
+		memmove(area + at, area + at + rec_len, end - at - rec_len);
+		memset(area + end - rec_len, 0, rec_len);
+		return;
+	}
+	struct dirent *d = area + at*sizeof(struct dirent);
+	d->valid = 0;
+}
+
+/*
+ * Hashed directory index
+ *
+ * Small directories are a linear list of entries in their direct blocks.
+ * When one needs more than DIR_HASH_THRESHOLD blocks it is converted to an
+ * extendible hash: an index block maps name hashes to bucket blocks, so a
+ * lookup or insert touches two blocks however large the directory grows.
+ * A full bucket is split in two (doubling the index when needed).
+ */
+#define DIR_HASH_THRESHOLD	2
+#define DIRHASH_AREA	(BLOCK_SIZE - sizeof(struct dir_bucket))
+
+static uint32_t dirhash(const char *name, size_t len) {
+	return name_hash(0, name, len);
+}
+
+//Bucket block that index pointer p leads to
+static int dirhash_bucket(const struct dir_index *idx, uint32_t p) {
+	int pblk = idx->page[p >> DIRHASH_PAGE_SHIFT];
+	const uint32_t *ptrs = bio_map(pblk);
+	void *buf = NULL;
+
+	if(ptrs == NULL){
+		buf = bio_alloc();
+		bio_read(pblk, buf);
+		ptrs = buf;
+	}
+	int blk = ptrs[p & (DIRHASH_PAGE_PTRS - 1)];
+	bio_free(buf);
+	return blk;
+}
+
+//Point every step-th index pointer from first on at bucket blk
+static void dirhash_repoint(struct dir_index *idx, uint32_t first, uint32_t step, int blk) {
+	uint32_t *ptrs = bio_alloc();
+	int page = -1;
+
+	for(uint32_t p = first; p < (1u << idx->depth); p += step){
+		if((int)(p >> DIRHASH_PAGE_SHIFT) != page){
+			if(page >= 0){
+				bio_write(idx->page[page], ptrs);
+			}
+			page = p >> DIRHASH_PAGE_SHIFT;
+			bio_read(idx->page[page], ptrs);
+		}
+		ptrs[p & (DIRHASH_PAGE_PTRS - 1)] = blk;
+	}
+	if(page >= 0){
+		bio_write(idx->page[page], ptrs);
+	}
+	bio_free(ptrs);
+}
+
+//Double the index: pointers 2^depth.. start out as copies of 0..2^depth-1
+static int dirhash_double(struct dir_index *idx) {
+	uint32_t *ptrs = bio_alloc();
+	int ret = 0;
+
+	if(idx->depth < DIRHASH_PAGE_SHIFT){
+		bio_read(idx->page[0], ptrs);
+		memcpy(&ptrs[1u << idx->depth], ptrs, (1u << idx->depth)*sizeof(uint32_t));
+		bio_write(idx->page[0], ptrs);
+	}else{
+		uint32_t n = idx->npages;
+		for(uint32_t k = 0; k < n; k++){
+			int blk = get_avail_blkno();
+			if(blk < 0){
+				while(k-- > 0){
+					free_blkno(idx->page[n + k]);
+				}
+				ret = -1;
+				break;
+			}
+			bio_read(idx->page[k], ptrs);
+			bio_write(blk, ptrs);
+			idx->page[n + k] = blk;
+		}
+		if(ret == 0){
+			idx->npages = 2*n;
+		}
+	}
+	if(ret == 0){
+		idx->depth++;
+	}
+	bio_free(ptrs);
+	return ret;
+}
+
+//Release every bucket and index page of idx (not the index block itself)
+static void dirhash_free(struct dir_index *idx) {
+	struct dir_bucket *b = bio_alloc();
+	for(uint32_t p = 0; p < (1u << idx->depth); p++){
+		int blk = dirhash_bucket(idx, p);
+		bio_read(blk, b);
+		// each bucket once, at the first pointer to it
+		if((p >> b->depth) == 0){
+			free_blkno(blk);
+		}
+	}
+	for(uint32_t k = 0; k < idx->npages; k++){
+		free_blkno(idx->page[k]);
+	}
+	bio_free(b);
+}
+
+static int dirhash_find(struct inode *dir_inode, const char *fname, size_t name_len, struct dirent *dirent) {
+	const struct dir_index *idx = bio_map(dir_inode->direct_ptr[0]);
+	void *ibuf = NULL, *bbuf = NULL;
+	int ret = -1;
+
+	if(idx == NULL){
+		ibuf = bio_alloc();
+		bio_read(dir_inode->direct_ptr[0], ibuf);
+		idx = ibuf;
+	}
+	int blk = dirhash_bucket(idx, dirhash(fname, name_len) & ((1u << idx->depth) - 1));
+	const struct dir_bucket *b = bio_map(blk);
+	if(b == NULL){
+		bbuf = bio_alloc();
+		bio_read(blk, bbuf);
+		b = bbuf;
+	}
+	if(dblk_find(b->ents, DIRHASH_AREA, fname, name_len, dirent) >= 0){
+		ret = 0;
+	}
+	bio_free(ibuf);
+	bio_free(bbuf);
+	return ret;
+}
+
+/*
+ * Put an entry into its bucket, splitting full buckets (and doubling the
+ * index) as needed. The caller writes idx back.
+ */
+static int dirhash_insert(struct dir_index *idx, uint16_t f_ino, const char *fname, size_t name_len) {
+	uint32_t h = dirhash(fname, name_len);
+	struct dir_bucket *b = bio_alloc();
+	struct dir_bucket *nb = bio_alloc();
+	struct dir_bucket *old = bio_alloc();
+	int ret = -1;
+
+	for(;;){
+		int blk = dirhash_bucket(idx, h & ((1u << idx->depth) - 1));
+		bio_read(blk, b);
+		if(dblk_insert(b->ents, DIRHASH_AREA, f_ino, fname, name_len) == 0){
+			b->count++;
+			bio_write(blk, b);
+			ret = 0;
+			break;
+		}
+
+		// Bucket is full: split it on hash bit b->depth
+		if(b->depth == idx->depth){
+			if(idx->depth == DIRHASH_MAX_DEPTH || dirhash_double(idx) < 0){
+				break;
+			}
+		}
+		int nblk = get_avail_blkno();
+		if(nblk < 0){
+			break;
+		}
+		uint32_t bit = 1u << b->depth;
+		memcpy(old, b, BLOCK_SIZE);
+		memset(b->ents, 0, DIRHASH_AREA);
+		memset(nb, 0, BLOCK_SIZE);
+		b->depth++;
+		b->count = 0;
+		nb->depth = b->depth;
+		struct dirent ent;
+		int pos = 0, at;
+		while(dblk_next(old->ents, DIRHASH_AREA, &pos, &at, &ent)){
+			struct dir_bucket *to = (dirhash(ent.name, ent.len) & bit) ? nb : b;
+			dblk_insert(to->ents, DIRHASH_AREA, ent.ino, ent.name, ent.len);
+			to->count++;
+		}
+		// the pointers to the old bucket agree with h on the low b->depth - 1
+		// bits; those with the split bit set now lead to the new one
+		dirhash_repoint(idx, (h & (bit - 1)) | bit, bit << 1, nblk);
+		idx->nbuckets++;
+		bio_write(blk, b);
+		bio_write(nblk, nb);
+	}
+	bio_free(b);
+	bio_free(nb);
+	bio_free(old);
+	return ret;
+}
+
+static int dirhash_add(struct inode *dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	struct dir_index *idx = bio_alloc();
+	bio_read(dir_inode->direct_ptr[0], idx);
+	int ret = dirhash_insert(idx, f_ino, fname, name_len);
+	bio_write(dir_inode->direct_ptr[0], idx);
+	dir_inode->size = (1 + idx->npages + idx->nbuckets)*BLOCK_SIZE;
+	bio_free(idx);
+	return ret;
+}
+
+//Remove fname from its bucket; returns the inode number it named, or -1
+static int dirhash_remove(struct inode *dir_inode, const char *fname, size_t name_len) {
+	struct dir_index *idx = bio_alloc();
+	struct dir_bucket *b = bio_alloc();
+	int ret = -1;
+
+	bio_read(dir_inode->direct_ptr[0], idx);
+	int blk = dirhash_bucket(idx, dirhash(fname, name_len) & ((1u << idx->depth) - 1));
+	bio_read(blk, b);
+	struct dirent ent;
+	int at = dblk_find(b->ents, DIRHASH_AREA, fname, name_len, &ent);
+	if(at >= 0){
+		dblk_remove(b->ents, DIRHASH_AREA, at);
+		b->count--;
+		bio_write(blk, b);
+		ret = ent.ino;
+	}
+	bio_free(idx);
+	bio_free(b);
+	return ret;
+}
+
+/*
+ * Turn a linear directory into a hashed one: rehash every entry into
+ * buckets and release the old linear blocks. If an entry cannot be moved,
+ * the new index is thrown away and the directory stays linear.
+ */
+static int dir_convert(struct inode *dir_inode) {
+	struct dir_index *idx = bio_alloc();
+	struct dir_bucket *b = bio_alloc();
+	void *buf = bio_alloc();
+	int iblk = get_avail_blkno();
+	int pblk = get_avail_blkno();
+	int bblk = get_avail_blkno();
+	int ret = 0;
+
+	if(iblk < 0 || pblk < 0 || bblk < 0){
+		if(iblk >= 0){
+			free_blkno(iblk);
+		}
+		if(pblk >= 0){
+			free_blkno(pblk);
+		}
+		if(bblk >= 0){
+			free_blkno(bblk);
+		}
+		bio_free(idx);
+		bio_free(b);
+		bio_free(buf);
+		return -1;
+	}
+	memset(idx, 0, BLOCK_SIZE);
+	memset(b, 0, BLOCK_SIZE);
+	idx->depth = 0;
+	idx->nbuckets = 1;
+	idx->npages = 1;
+	idx->page[0] = pblk;
+	bio_write(bblk, b);
+	memset(buf, 0, BLOCK_SIZE);
+	((uint32_t *)buf)[0] = bblk;
+	bio_write(pblk, buf);
+
+	for(int blk = 0; blk < 16 && dir_inode->direct_ptr[blk] != 0 && ret == 0; blk++){
+		struct dirent ent;
+		int pos = 0, at;
+		bio_read(dir_inode->direct_ptr[blk], buf);
+		while(ret == 0 && dblk_next(buf, BLOCK_SIZE, &pos, &at, &ent)){
+			ret = dirhash_insert(idx, ent.ino, ent.name, ent.len);
+		}
+	}
+	if(ret < 0){
+		dirhash_free(idx);
+		free_blkno(iblk);
+		bio_free(idx);
+		bio_free(b);
+		bio_free(buf);
+		return -1;
+	}
+	for(int blk = 0; blk < 16 && dir_inode->direct_ptr[blk] != 0; blk++){
+		free_blkno(dir_inode->direct_ptr[blk]);
+		dir_inode->direct_ptr[blk] = 0;
+	}
+	bio_write(iblk, idx);
+	dir_inode->direct_ptr[0] = iblk;
+	dir_inode->flags |= INODE_DIR_HASHED;
+	dir_inode->size = (1 + idx->npages + idx->nbuckets)*BLOCK_SIZE;
+	bio_free(idx);
+	bio_free(b);
+	bio_free(buf);
+	return 0;
+}
+
+static int dir_lookup(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+  struct inode *dir_inode = (struct inode*)malloc(sizeof(struct inode));
+  if(readi(ino, dir_inode) < 0 || dir_inode->type == FILE_TYPE){
+	free(dir_inode);
+	return -1;
+  }
+  if(dir_inode->flags & INODE_DIR_HASHED){
+	int ret = dirhash_find(dir_inode, fname, name_len, dirent);
+	free(dir_inode);
+	return ret;
+  }
+  // Step 2: Get data block of current directory from inode
+	int block;
+	void* buf = bio_alloc();
+  // Step 3: Read directory's data block and check each directory entry.
+  //If the name matches, then copy directory entry to dirent structure
+
+  for(int b = 0; b<16; b++){
+	if(dir_inode->direct_ptr[b] == 0){
+		break;
+	}
+
+	block = dir_inode->direct_ptr[b];
+	const void* ents = bio_map(block);
+	if(ents == NULL){
+		bio_read(block,buf);
+		ents = buf;
+	}
+	if(dblk_find(ents, BLOCK_SIZE, fname, name_len, dirent) >= 0){
+		bio_free(buf);
+		free(dir_inode);
+		return 0;
+	}
+  }
+	bio_free(buf);
+	free(dir_inode);
+	return -1;
+}
+
+static int dir_insert(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+
+	struct dirent ent;
+	if(name_len >= sizeof(ent.name)){
+		return -1;
+	}
+	if(dir_inode.flags & INODE_DIR_HASHED){
+		if(dirhash_find(&dir_inode, fname, name_len, &ent) == 0){
+			return -1;
+		}
+		// buckets split before a failed insert stay, so the size is saved either way
+		int ret = dirhash_add(&dir_inode, f_ino, fname, name_len);
+		if(ret == 0){
+			dir_inode.link+= 1;
+		}
+		writei(dir_inode.ino,&dir_inode);
+		if(ret < 0){
+			return -1;
+		}
+		dcache_insert(dir_inode.ino, fname, name_len, f_ino);
+		return 0;
+	}
+
+	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+	int block;
+	void* buf = bio_alloc();
+
+	// Step 2: Check if fname (directory name) is already used in other entries
+	int free_blk = -1;
+	for(int b = 0; b<16;b++){
+		if(dir_inode.direct_ptr[b] == 0){
+		break;
+	}
+		block = dir_inode.direct_ptr[b];
+		bio_read(block,buf);
+		if(dblk_find(buf, BLOCK_SIZE, fname, name_len, NULL) >= 0){
+			perror("dir already exists!");
+			bio_free(buf);
+			return -1;
+		}
+		if(free_blk == -1 && dblk_fits(buf, BLOCK_SIZE, name_len)){
+			free_blk = block;
+		}
+	}
+	// Step 3: Add directory entry in dir_inode's data block and write to disk
+
+	// Past the threshold, switch the directory to a hashed index instead
+	// (if that fails it stays linear and grows by another block)
+   if(free_blk == -1 && dir_inode.direct_ptr[DIR_HASH_THRESHOLD - 1] != 0 &&
+			dir_convert(&dir_inode) == 0){
+		bio_free(buf);
+		// the linear blocks are freed, so the inode must lead to the index
+		// even if the insert into it fails
+		writei(dir_inode.ino, &dir_inode);
+		return dir_insert(dir_inode, f_ino, fname, name_len);
+   }
+
+	// Allocate a new data block for this directory if it does not exist
+   if(free_blk == -1){
+		block = get_avail_blkno();
+		if(block <0){
+			perror("block allocation failed!");
+			bio_free(buf);
+			return -1;
+		}
+		int b;
+		for(b = 0; b <16; b++){
+			if(dir_inode.direct_ptr[b] == 0){
+				dir_inode.direct_ptr[b] = block;
+				break;
+			}
+		}
+		if(b == 16){
+			free_blkno(block);
+			bio_free(buf);
+			return -1;
+		}
+		memset(buf, 0, BLOCK_SIZE);
+   }else{
+		block = free_blk;
+		bio_read(block,buf);
+   }
+
+	// Update directory inode
+	//add something to edit inode modification time
+	dir_inode.size += dblk_entry_size(name_len);
+	dir_inode.link+= 1;
+	writei(dir_inode.ino,&dir_inode);
+	
+	// Write directory entry
+	dblk_insert(buf, BLOCK_SIZE, f_ino, fname, name_len);
+	bio_write(block,buf);
+	dcache_insert(dir_inode.ino, fname, name_len, f_ino);
+	bio_free(buf);
+	return 0;
+}
+
+//Remove fname from dir_inode; returns the inode number it named, or -1
+static int dir_delete(struct inode dir_inode, const char *fname, size_t name_len) {
+
+	if(dir_inode.flags & INODE_DIR_HASHED){
+		int f_ino = dirhash_remove(&dir_inode, fname, name_len);
+		if(f_ino < 0){
+			return -1;
+		}
+		dir_inode.link -=1;
+		writei(dir_inode.ino,&dir_inode);
+		dcache_insert(dir_inode.ino, fname, name_len, -1);
+		return f_ino;
+	}
+
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+
+	int block;
+	void* buf = bio_alloc();
+	struct dirent ent;
+	int at = -1;
+
+	// Step 2: Check if fname exist
+	for(int b = 0; b<16; b++){
+		if(dir_inode.direct_ptr[b] == 0){
+		break;
+	}
+		block = dir_inode.direct_ptr[b];
+		bio_read(block,buf);
+		at = dblk_find(buf, BLOCK_SIZE, fname, name_len, &ent);
+		if(at != -1){
+			break;
+		}
+	}
+	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+	// (compact blocks are squeezed so their free space stays at the end)
+	if(at !=-1){
+		dblk_remove(buf, BLOCK_SIZE, at);
+		bio_write(block,buf);
+		dir_inode.size -= dblk_entry_size(name_len);
+		dir_inode.link -=1;
+		//edit dir_inode mod time
+		writei(dir_inode.ino,&dir_inode);
+		dcache_insert(dir_inode.ino, fname, name_len, -1);
+		bio_free(buf);
+		return ent.ino;
+	}
+	printf("Entry Not Found!");
+	bio_free(buf);
+	return -1;
+}
+
+/*
+ * The exported directory operations hold the directory's inode lock:
+ * shared for lookups, exclusive for changes. Changes start from the
+ * directory inode as it is now, not the caller's possibly stale copy.
+ */
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	struct dirent ent;
+	struct inode *ip = iget(ino);
+	if(ip == NULL){
+		return -1;
+	}
+	if(dirent == NULL){
+		dirent = &ent;
+	}
+	ilock(ip, 0);
+	int ret = dir_lookup(ino, fname, name_len, dirent);
+	// cache the answer before a writer can change the directory
+	if(ip->type != FILE_TYPE){
+		dcache_insert(ino, fname, name_len, ret == 0 ? dirent->ino : -1);
+	}
+	iunlock(ip);
+	iput(ip);
+	return ret;
+}
+
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	struct inode *ip = iget(dir_inode.ino);
+	if(ip == NULL){
+		return -1;
+	}
+	ilock(ip, 1);
+	alloc_near(dir_inode.ino);
+	int ret = readi(dir_inode.ino, &dir_inode);
+	if(ret == 0){
+		ret = dir_insert(dir_inode, f_ino, fname, name_len);
+	}
+	iunlock(ip);
+	iput(ip);
+	return ret;
+}
+
+//Returns the inode number the removed entry named, or -1
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+	struct inode *ip = iget(dir_inode.ino);
+	if(ip == NULL){
+		return -1;
+	}
+	ilock(ip, 1);
+	int ret = readi(dir_inode.ino, &dir_inode);
+	if(ret == 0){
+		ret = dir_delete(dir_inode, fname, name_len);
+	}
+	iunlock(ip);
+	iput(ip);
+	return ret;
+}
+
+/*
+ * Directory cursors
+ *
+ * A position in a directory is a key made from the entry's name alone: its
+ * dirhash() bit-reversed, above bits of a second hash that order names whose
+ * dirhash is the same. Entries are listed in key order and the cursor past
+ * one is its key plus one, so offset 0 is the start of the directory. As no
+ * key depends on where its entry is stored, records sliding down over a
+ * removed one, bucket splits and a linear directory being hashed all leave
+ * a cursor where it was. (Of two names with the same key, a 2^-62 chance,
+ * a listing resumed between them would miss the second.)
+ *
+ * Bit reversal puts the hash bits that pick a bucket on top: a bucket of
+ * local depth d holds the keys with one value of their top d bits, and its
+ * index pointers are 2^(depth - d) consecutive ones in bit-reversed order.
+ * So a hashed directory is listed a bucket at a time, each one sorted, by
+ * walking the index in that order. A linear directory is sorted whole.
+ */
+#define DIR_KEY_LOW		30
+#define DIR_KEY_SEED	0x9e3779b9u
+
+static uint32_t bitrev32(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+static uint64_t dir_key(const char *name, size_t len) {
+	uint32_t low = name_hash(DIR_KEY_SEED, name, len) & ((1u << DIR_KEY_LOW) - 1);
+	return ((uint64_t)bitrev32(dirhash(name, len)) << DIR_KEY_LOW) | low;
+}
+
+//Entries of a listing step, to be sorted by key
+struct dir_slots {
+	int n, cap;
+	struct dir_slot {
+		uint64_t key;
+		const void *area;			/* block area holding the entry */
+		int at;						/* and its position there */
+	} *s;
+};
+
+static int dir_slot_cmp(const void *a, const void *b) {
+	uint64_t x = ((const struct dir_slot *)a)->key, y = ((const struct dir_slot *)b)->key;
+	return x < y ? -1 : x > y;
+}
+
+//Note the entries of area with keys from off on; -1 if out of memory
+static int dir_slots_add(struct dir_slots *sl, const void *area, size_t area_len, uint64_t off) {
+	struct dirent ent;
+	int pos = 0, at;
+	while(dblk_next(area, area_len, &pos, &at, &ent)){
+		uint64_t key = dir_key(ent.name, ent.len);
+		if(key < off){
+			continue;
+		}
+		if(sl->n == sl->cap){
+			int cap = sl->cap ? sl->cap*2 : 64;
+			struct dir_slot *s = realloc(sl->s, cap*sizeof(*s));
+			if(s == NULL){
+				return -1;
+			}
+			sl->s = s;
+			sl->cap = cap;
+		}
+		sl->s[sl->n].key = key;
+		sl->s[sl->n].area = area;
+		sl->s[sl->n].at = at;
+		sl->n++;
+	}
+	return 0;
+}
+
+//Call fn on the noted entries in key order and forget them
+static int dir_slots_emit(struct dir_slots *sl, size_t area_len, int (*fn)(void *arg, const struct dirent *ent, off_t next), void *arg) {
+	struct dirent ent;
+	int ret = 0;
+	if(sl->n > 1){
+		qsort(sl->s, sl->n, sizeof(*sl->s), dir_slot_cmp);
+	}
+	for(int i = 0; i < sl->n && ret == 0; i++){
+		int pos = sl->s[i].at, at;
+		dblk_next(sl->s[i].area, area_len, &pos, &at, &ent);
+		ret = fn(arg, &ent, sl->s[i].key + 1);
+	}
+	sl->n = 0;
+	return ret;
+}
+
+/*
+ * Call fn on every entry of directory ino from cursor off on, with the
+ * cursor just past the entry, until fn returns nonzero (which is then
+ * returned). Entries come in key order, so those that were there when a
+ * listing started and still are come once each, however it is resumed.
+ */
+int dir_foreach(uint16_t ino, off_t off, int (*fn)(void *arg, const struct dirent *ent, off_t next), void *arg) {
+	struct inode dir_inode;
+	struct dir_slots sl = {0, 0, NULL};
+	int ret = 0;
+
+	struct inode *ip = iget(ino);
+	if(ip == NULL){
+		return -1;
+	}
+	ilock(ip, 0);
+	readi(ino, &dir_inode);
+	if(dir_inode.flags & INODE_DIR_HASHED){
+		struct dir_index *idx = bio_alloc();
+		struct dir_bucket *b = bio_alloc();
+		bio_read(dir_inode.direct_ptr[0], idx);
+		int depth = idx->depth;
+		// i walks the index pointers in bit-reversed order, from the bucket off is in
+		uint64_t i = depth ? ((uint64_t)off >> DIR_KEY_LOW) >> (32 - depth) : 0;
+		while(i < (1ull << depth) && ret == 0){
+			uint32_t p = depth ? bitrev32((uint32_t)i) >> (32 - depth) : 0;
+			bio_read(dirhash_bucket(idx, p), b);
+			if(dir_slots_add(&sl, b->ents, DIRHASH_AREA, off) < 0){
+				ret = -1;
+				break;
+			}
+			ret = dir_slots_emit(&sl, DIRHASH_AREA, fn, arg);
+			// skip the bucket's other pointers
+			uint64_t span = 1ull << (depth - b->depth);
+			i = (i & ~(span - 1)) + span;
+		}
+		bio_free(idx);
+		bio_free(b);
+	}else{
+		void *bufs[16];
+		int nblk = 0;
+		while(nblk < 16 && dir_inode.direct_ptr[nblk] != 0 && ret == 0){
+			bufs[nblk] = bio_alloc();
+			bio_read(dir_inode.direct_ptr[nblk], bufs[nblk]);
+			ret = dir_slots_add(&sl, bufs[nblk++], BLOCK_SIZE, off);
+		}
+		if(ret == 0){
+			ret = dir_slots_emit(&sl, BLOCK_SIZE, fn, arg);
+		}
+		while(nblk > 0){
+			bio_free(bufs[--nblk]);
+		}
+	}
+	free(sl.s);
+	iunlock(ip);
+	iput(ip);
+	return ret;
+}
+
+/* 
+ * namei operation
+ */
+//Deepest part of a path walk kept pinned in the inode cache
+#define WALK_PIN_MAX 32
+
+//Returns 0, -ENOENT, or -ENOTDIR when a component before the last is not a directory
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Note: You could either implement it in a iterative way or recursive way
+	if(path[0] == '\0'){
+		printf("ERROR: empty path!!");
+		return -ENOENT;
+	}
+    char delim[] = "/"; // Delimiter to split the path
+	char *paths = strdup(path);
+	char *saveptr;
+    char *token = strtok_r(paths, delim,&saveptr);
+
+	//look each component up in the directory found so far, keeping the
+	//directories on the walk pinned in the inode cache until it is done
+	struct inode *chain[WALK_PIN_MAX];
+	int depth = 0, ret = 0;
+	struct dirent tmp;
+	struct inode dir;
+    while (token != NULL) {
+		// only a directory has further components in it (a file's block
+		// pointers, or its extent tree, are no directory blocks)
+		const struct inode *dp = NULL;
+		if(depth < WALK_PIN_MAX && (chain[depth] = iget(ino)) != NULL){
+			dp = chain[depth++];
+		}else if(readi(ino, &dir) == 0){
+			dp = &dir;
+		}
+		if(dp == NULL){
+			ret = -ENOENT;
+			break;
+		}
+		if(dp->type == FILE_TYPE){
+			ret = -ENOTDIR;
+			break;
+		}
+		size_t len = strlen(token);
+		int child = dcache_lookup(ino, token, len);
+		if(child == DCACHE_NEG){
+			ret = -ENOENT;
+			break;
+		}
+		if(child < 0){
+			if(dir_find(ino, token, len, &tmp) < 0){
+				ret = -ENOENT;
+				break;
+			}
+			child = tmp.ino;
+		}
+		ino = child;
+        token = strtok_r(NULL, delim,&saveptr);
+    }
+	if(ret == 0 && readi(ino,inode) < 0){
+		ret = -ENOENT;
+	}
+	while(depth > 0){
+		iput(chain[--depth]);
+	}
+	free(paths);
+	
+	return ret;
+}
+/* 
+ * Block mapping
+ *
+ * A file's blocks are found either through block pointers (direct,
+ * single- and double-indirect) or, for INODE_EXTENTS inodes, through an
+ * extent tree. Pointer blocks and extent tree nodes are held in a small
+ * direct-mapped cache of their contents, so walking a file front to back
+ * fetches each of them from the block layer once rather than once per
+ * data block. Updates are written through to the block layer.
+ * The caller holds the inode's lock; bmap_lock guards the shared cache.
+ */
+#define BMAP_CACHE_SIZE	64
+
+struct bmap_entry {
+	int blk;						/* map block cached here, 0 if none */
+	int *ptrs;						/* its contents (a bio_alloc buffer) */
+};
+
+static struct bmap_entry bmap_cache[BMAP_CACHE_SIZE];
+static pthread_mutex_t bmap_lock = PTHREAD_MUTEX_INITIALIZER;
+//Bumped whenever an existing mapping may have changed (see bmap_generation)
+static unsigned int bmap_gen = 0;
+
+static void bmap_init() {
+	for(int i = 0; i < BMAP_CACHE_SIZE; i++){
+		bmap_cache[i].blk = 0;
+	}
+}
+
+static void bmap_destroy() {
+	for(int i = 0; i < BMAP_CACHE_SIZE; i++){
+		bio_free(bmap_cache[i].ptrs);
+		bmap_cache[i].ptrs = NULL;
+		bmap_cache[i].blk = 0;
+	}
+}
+
+//Cache slot for map block blk, with its buffer allocated
+static struct bmap_entry *bmap_entry(int blk) {
+	struct bmap_entry *e = &bmap_cache[blk % BMAP_CACHE_SIZE];
+	if(e->ptrs == NULL && (e->ptrs = bio_alloc()) == NULL){
+		return NULL;
+	}
+	return e;
+}
+
+//Cached contents of map block blk
+static void *bmap_block(int blk) {
+	struct bmap_entry *e = bmap_entry(blk);
+	if(e == NULL){
+		return NULL;
+	}
+	if(e->blk != blk){
+		if(bio_read(blk, e->ptrs) < 0){
+			e->blk = 0;
+			return NULL;
+		}
+		e->blk = blk;
+	}
+	return e->ptrs;
+}
+
+//Drop the cached copy of map block blk, which is being freed
+static void bmap_forget(int blk) {
+	struct bmap_entry *e = &bmap_cache[blk % BMAP_CACHE_SIZE];
+	if(e->blk == blk){
+		e->blk = 0;
+	}
+}
+
+//Write map block blk from buf, keeping any cached copy in step
+static int bmap_write(int blk, const void *buf) {
+	struct bmap_entry *e = &bmap_cache[blk % BMAP_CACHE_SIZE];
+	if(e->blk == blk && e->ptrs != buf){
+		memcpy(e->ptrs, buf, BLOCK_SIZE);
+	}
+	return bio_write(blk, buf);
+}
+
+/*
+ * Contents of pointer block ptrs[idx] (ptrs itself lives in block pblk, or
+ * in the inode when pblk is 0). With alloc, a missing pointer block is
+ * allocated zeroed and linked in; the inode is left for the caller to write.
+ * *blk gets the pointer block's number.
+ */
+static int *bmap_child(int *ptrs, int pblk, int idx, int alloc, int *blk) {
+	struct bmap_entry *e;
+	int child = ptrs[idx];
+
+	if(child == 0){
+		if(!alloc || (child = get_avail_blkno()) < 0){
+			return NULL;
+		}
+		ptrs[idx] = child;
+		if(pblk != 0 && bio_write(pblk, ptrs) < 0){
+			return NULL;
+		}
+		if((e = bmap_entry(child)) == NULL){
+			return NULL;
+		}
+		memset(e->ptrs, 0, BLOCK_SIZE);
+		e->blk = child;
+		bio_write(child, e->ptrs);
+		*blk = child;
+		return e->ptrs;
+	}
+	*blk = child;
+	return bmap_block(child);
+}
+
+/*
+ * Find the pointer array holding logical block lb: returns the array and
+ * sets *idx to lb's slot in it and *pblk to the block it lives in (0 for
+ * the inode itself). NULL if lb is past the largest file or, without
+ * alloc, falls in a hole.
+ */
+static int *bmap_slot(struct inode *inode, int lb, int alloc, int *idx, int *pblk) {
+	int *ptrs, blk;
+
+	*pblk = 0;
+	if(lb < 0){
+		return NULL;
+	}
+	if(lb < NDIRECT){
+		*idx = lb;
+		return inode->direct_ptr;
+	}
+	lb -= NDIRECT;
+	if(lb < NINDIRECT*PTRS_PER_BLK){
+		ptrs = bmap_child(inode->indirect_ptr, 0, lb / PTRS_PER_BLK, alloc, &blk);
+	}else{
+		lb -= NINDIRECT*PTRS_PER_BLK;
+		if(lb / (PTRS_PER_BLK*PTRS_PER_BLK) >= NDINDIRECT){
+			return NULL;
+		}
+		ptrs = bmap_child(inode->indirect_ptr, 0, NINDIRECT + lb / (PTRS_PER_BLK*PTRS_PER_BLK), alloc, &blk);
+		if(ptrs != NULL){
+			ptrs = bmap_child(ptrs, blk, (lb / PTRS_PER_BLK) % PTRS_PER_BLK, alloc, &blk);
+		}
+	}
+	if(ptrs == NULL){
+		return NULL;
+	}
+	*idx = lb % PTRS_PER_BLK;
+	*pblk = blk;
+	return ptrs;
+}
+
+/*
+ * Free what pointer block blk maps from its own logical block first on:
+ * data blocks at depth 1, and at depth 2 the pointer blocks below too.
+ * A pointer block is left for the caller to free when first is 0.
+ */
+static void bmap_cut(int blk, int depth, int first) {
+	int span = depth == 1 ? 1 : PTRS_PER_BLK;
+	int *ptrs = bio_alloc();
+	if(bio_read(blk, ptrs) < 0){
+		bio_free(ptrs);
+		return;
+	}
+	for(int k = first/span; k < PTRS_PER_BLK; k++){
+		if(ptrs[k] == 0){
+			continue;
+		}
+		int from = first - k*span;
+		if(from > 0){
+			bmap_cut(ptrs[k], depth - 1, from);
+			continue;
+		}
+		if(depth > 1){
+			bmap_cut(ptrs[k], depth - 1, 0);
+			bmap_forget(ptrs[k]);
+		}
+		free_blkno(ptrs[k]);
+		ptrs[k] = 0;
+	}
+	if(first > 0){
+		bmap_write(blk, ptrs);
+	}
+	bio_free(ptrs);
+}
+
+/*
+ * Extent trees
+ *
+ * Inserts split full nodes on the way down (a full root is first pushed
+ * down into a block of its own), so the leaf reached always has room.
+ * New blocks that continue an extent on disk just lengthen it.
+ */
+static struct ext_header *ext_root(struct inode *inode) {
+	return (struct ext_header *)inode->ext_root;
+}
+
+//Last entry of node h starting at or before lb, or -1
+static int ext_search(struct ext_header *h, uint32_t lb) {
+	struct extent *e = EXT_ENTS(h);
+	int lo = 0, hi = h->entries - 1, ret = -1;
+	while(lo <= hi){
+		int mid = (lo + hi)/2;
+		if(e[mid].lblk <= lb){
+			ret = mid;
+			lo = mid + 1;
+		}else{
+			hi = mid - 1;
+		}
+	}
+	return ret;
+}
+
+//Disk block of lb (0 in a hole); *len gets the blocks left in its extent
+static int ext_map(struct inode *inode, uint32_t lb, int *len) {
+	struct ext_header *h = ext_root(inode);
+	int i;
+
+	while(h->depth > 0){
+		i = ext_search(h, lb);
+		h = bmap_block(EXT_ENTS(h)[i < 0 ? 0 : i].pblk);
+		if(h == NULL || h->magic != EXT_MAGIC){
+			return 0;
+		}
+	}
+	if((i = ext_search(h, lb)) < 0){
+		return 0;
+	}
+	struct extent *e = &EXT_ENTS(h)[i];
+	if(lb >= e->lblk + e->len){
+		return 0;
+	}
+	*len = e->lblk + e->len - lb;
+	return e->pblk + (lb - e->lblk);
+}
+
+//Move a full root down into a new block, leaving the root one index entry
+static int ext_grow(struct inode *inode) {
+	struct ext_header *root = ext_root(inode);
+	int blk = get_avail_blkno();
+	if(blk < 0){
+		return -1;
+	}
+	struct ext_header *h = bio_alloc();
+	memset(h, 0, BLOCK_SIZE);
+	memcpy(h, root, sizeof(struct ext_header) + root->entries*sizeof(struct extent));
+	h->max = EXT_NODE_MAX;
+	bmap_write(blk, h);
+	bio_free(h);
+
+	struct extent *e = EXT_ENTS(root);
+	e[0].pblk = blk;
+	e[0].len = 0;
+	root->entries = 1;
+	root->depth++;
+	return 0;
+}
+
+//Map the unmapped logical blocks [lb, lb+len) to disk blocks from pblk
+static int ext_insert(struct inode *inode, uint32_t lb, uint32_t pblk, uint32_t len) {
+	struct ext_header *root = ext_root(inode);
+	if(root->entries == root->max && ext_grow(inode) < 0){
+		return -1;
+	}
+
+	// cur is the node being descended, cur_blk its block (0 for the root,
+	// which goes back to disk with the inode); bufs rotate between levels
+	struct ext_header *bufs[3] = {bio_alloc(), bio_alloc(), bio_alloc()};
+	struct ext_header *cur = root;
+	int cur_blk = 0, ret = -1;
+	while(cur->depth > 0){
+		struct extent *e = EXT_ENTS(cur);
+		int i = ext_search(cur, lb);
+		if(i < 0){
+			// lb sorts before everything below cur: widen the first child
+			i = 0;
+			e[0].lblk = lb;
+			if(cur_blk != 0){
+				bmap_write(cur_blk, cur);
+			}
+		}
+		struct ext_header *child = NULL, *split = NULL;
+		for(int k = 0; k < 3; k++){
+			if(bufs[k] == cur){
+				continue;
+			}
+			if(child == NULL){
+				child = bufs[k];
+			}else{
+				split = bufs[k];
+			}
+		}
+		int child_blk = e[i].pblk;
+		if(bio_read(child_blk, child) < 0 || child->magic != EXT_MAGIC){
+			goto out;
+		}
+		if(child->entries == child->max){
+			// Move the upper half of child to a new node after it
+			int nblk = get_avail_blkno();
+			if(nblk < 0){
+				goto out;
+			}
+			int half = child->entries/2;
+			memset(split, 0, BLOCK_SIZE);
+			split->magic = EXT_MAGIC;
+			split->max = EXT_NODE_MAX;
+			split->depth = child->depth;
+			split->entries = child->entries - half;
+			memcpy(EXT_ENTS(split), EXT_ENTS(child) + half, split->entries*sizeof(struct extent));
+			child->entries = half;
+			memmove(&e[i + 2], &e[i + 1], (cur->entries - i - 1)*sizeof(struct extent));
+			e[i + 1].lblk = EXT_ENTS(split)[0].lblk;
+			e[i + 1].pblk = nblk;
+			e[i + 1].len = 0;
+			cur->entries++;
+			bmap_write(nblk, split);
+			bmap_write(child_blk, child);
+			if(cur_blk != 0){
+				bmap_write(cur_blk, cur);
+			}
+			if(lb >= EXT_ENTS(split)[0].lblk){
+				child = split;
+				child_blk = nblk;
+			}
+		}
+		cur = child;
+		cur_blk = child_blk;
+	}
+
+	// cur is a leaf with room: extend a neighbour or add a new extent
+	struct extent *e = EXT_ENTS(cur);
+	int i = ext_search(cur, lb);
+	if(i >= 0 && e[i].lblk + e[i].len == lb && e[i].pblk + e[i].len == pblk){
+		e[i].len += len;
+	}else if(i + 1 < cur->entries && lb + len == e[i + 1].lblk && pblk + len == e[i + 1].pblk){
+		e[i + 1].lblk = lb;
+		e[i + 1].pblk = pblk;
+		e[i + 1].len += len;
+	}else{
+		memmove(&e[i + 2], &e[i + 1], (cur->entries - i - 1)*sizeof(struct extent));
+		e[i + 1].lblk = lb;
+		e[i + 1].pblk = pblk;
+		e[i + 1].len = len;
+		cur->entries++;
+	}
+	if(cur_blk != 0){
+		bmap_write(cur_blk, cur);
+	}
+	ret = 0;
+out:
+	for(int k = 0; k < 3; k++){
+		bio_free(bufs[k]);
+	}
+	return ret;
+}
+
+//Unmap logical block lb; one taken from inside an extent splits it in two
+static int ext_remove(struct inode *inode, uint32_t lb) {
+	struct ext_header *cur = ext_root(inode);
+	struct ext_header *buf = bio_alloc();
+	int cur_blk = 0, i;
+
+	while(cur->depth > 0){
+		i = ext_search(cur, lb);
+		cur_blk = EXT_ENTS(cur)[i < 0 ? 0 : i].pblk;
+		if(bio_read(cur_blk, buf) < 0){
+			bio_free(buf);
+			return -1;
+		}
+		cur = buf;
+	}
+	i = ext_search(cur, lb);
+	struct extent *e = &EXT_ENTS(cur)[i < 0 ? 0 : i];
+	if(i < 0 || lb >= e->lblk + e->len){
+		bio_free(buf);
+		return 0;
+	}
+	uint32_t off = lb - e->lblk;
+	uint32_t tail = e->len - off - 1;
+	uint32_t tail_pblk = e->pblk + off + 1;
+	if(off == 0){
+		e->lblk++;
+		e->pblk++;
+		e->len--;
+		tail = 0;
+	}else{
+		e->len = off;
+	}
+	if(e->len == 0){
+		memmove(e, e + 1, (cur->entries - i - 1)*sizeof(struct extent));
+		cur->entries--;
+	}
+	if(cur_blk != 0){
+		bmap_write(cur_blk, cur);
+	}
+	bio_free(buf);
+	if(tail > 0){
+		return ext_insert(inode, lb + 1, tail_pblk, tail);
+	}
+	return 0;
+}
+
+/*
+ * Free what node h (in block blk, 0 for the root) maps from lb on. Children
+ * left with no entries are freed and dropped from h, which is written back
+ * when it changed. Returns the entries h has left.
+ */
+static int ext_cut(struct ext_header *h, int blk, uint32_t lb) {
+	struct extent *e = EXT_ENTS(h);
+	int n = h->entries;
+
+	for(int i = n - 1; i >= 0; i--){
+		if(h->depth == 0){
+			uint32_t keep = e[i].lblk < lb ? lb - e[i].lblk : 0;
+			for(uint32_t k = keep; k < e[i].len; k++){
+				free_blkno(e[i].pblk + k);
+			}
+			if(keep > 0){
+				e[i].len = keep < e[i].len ? keep : e[i].len;
+				break;
+			}
+			h->entries--;
+			continue;
+		}
+		uint32_t start = e[i].lblk;
+		struct ext_header *child = bio_alloc();
+		if(bio_read(e[i].pblk, child) >= 0 && child->magic == EXT_MAGIC && ext_cut(child, e[i].pblk, lb) == 0){
+			bmap_forget(e[i].pblk);
+			free_blkno(e[i].pblk);
+			memmove(&e[i], &e[i + 1], (h->entries - i - 1)*sizeof(struct extent));
+			h->entries--;
+		}
+		bio_free(child);
+		if(start < lb){
+			break;
+		}
+	}
+	if(blk != 0){
+		bmap_write(blk, h);
+	}
+	return h->entries;
+}
+
+//Cut the tree down to lb, then pull a lone child up into the root
+static void ext_truncate(struct inode *inode, uint32_t lb) {
+	struct ext_header *root = ext_root(inode);
+	struct ext_header *child = bio_alloc();
+
+	ext_cut(root, 0, lb);
+	while(root->depth > 0 && root->entries == 1){
+		int blk = EXT_ENTS(root)[0].pblk;
+		if(bio_read(blk, child) < 0 || child->magic != EXT_MAGIC || child->entries > EXT_ROOT_MAX){
+			break;
+		}
+		memcpy(EXT_ENTS(root), EXT_ENTS(child), child->entries*sizeof(struct extent));
+		root->entries = child->entries;
+		root->depth = child->depth;
+		bmap_forget(blk);
+		free_blkno(blk);
+	}
+	if(root->entries == 0){
+		root->depth = 0;
+	}
+	bio_free(child);
+}
+
+/* 
+ * Give a file with no blocks yet the layout new files get on this disk
+ */
+void bmap_format(struct inode *inode) {
+	if(!(superBlock->features & FEATURE_EXTENTS) || (inode->flags & INODE_EXTENTS)){
+		return;
+	}
+	for(int i = 0; i < 24; i++){
+		if(inode->ext_root[i] != 0){
+			return;
+		}
+	}
+	struct ext_header *root = ext_root(inode);
+	root->magic = EXT_MAGIC;
+	root->max = EXT_ROOT_MAX;
+	inode->flags |= INODE_EXTENTS;
+}
+
+//bmap_extent() with bmap_lock held
+static int bmap_find(struct inode *inode, int lb, int *len) {
+	int idx, pblk;
+	*len = 1;
+	if(inode->flags & INODE_EXTENTS){
+		return lb < 0 ? 0 : ext_map(inode, lb, len);
+	}
+	int *ptrs = bmap_slot(inode, lb, 0, &idx, &pblk);
+	return ptrs != NULL ? ptrs[idx] : 0;
+}
+
+//bmap_set() with bmap_lock held
+static int bmap_store(struct inode *inode, int lb, int blk) {
+	int idx, pblk, len;
+	if(inode->flags & INODE_EXTENTS){
+		if(lb < 0 || (bmap_find(inode, lb, &len) != 0 && ext_remove(inode, lb) < 0)){
+			return -1;
+		}
+		return blk != 0 ? ext_insert(inode, lb, blk, 1) : 0;
+	}
+	int *ptrs = bmap_slot(inode, lb, blk != 0, &idx, &pblk);
+	if(ptrs == NULL){
+		return blk != 0 ? -1 : 0;
+	}
+	ptrs[idx] = blk;
+	if(pblk != 0 && bio_write(pblk, ptrs) < 0){
+		return -1;
+	}
+	return 0;
+}
+
+/* 
+ * Disk block holding logical block lb of inode, or 0 for a hole
+ */
+int bmap(struct inode *inode, int lb) {
+	int len;
+	return bmap_extent(inode, lb, &len);
+}
+
+/* 
+ * Like bmap(), also setting *len to how many blocks from lb on are known
+ * to follow contiguously on disk from the same lookup (at least 1)
+ */
+int bmap_extent(struct inode *inode, int lb, int *len) {
+	pthread_mutex_lock(&bmap_lock);
+	int ret = bmap_find(inode, lb, len);
+	pthread_mutex_unlock(&bmap_lock);
+	return ret;
+}
+
+/* 
+ * Map logical block lb of inode to disk block blk (0 unmaps it), allocating
+ * pointer blocks or tree nodes on the way. The caller writes the inode back.
+ */
+int bmap_set(struct inode *inode, int lb, int blk) {
+	pthread_mutex_lock(&bmap_lock);
+	int ret = bmap_store(inode, lb, blk);
+	__atomic_add_fetch(&bmap_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&bmap_lock);
+	return ret;
+}
+
+/*
+ * Unmap and free every block of inode from logical block nb on, with the
+ * pointer blocks or extent tree nodes left mapping nothing. The caller
+ * writes the inode back.
+ */
+int bmap_truncate(struct inode *inode, int nb) {
+	pthread_mutex_lock(&bmap_lock);
+	if(inode->flags & INODE_EXTENTS){
+		ext_truncate(inode, nb < 0 ? 0 : nb);
+		__atomic_add_fetch(&bmap_gen, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&bmap_lock);
+		return 0;
+	}
+	for(int lb = nb < 0 ? 0 : nb; lb < NDIRECT; lb++){
+		if(inode->direct_ptr[lb] != 0){
+			free_blkno(inode->direct_ptr[lb]);
+			inode->direct_ptr[lb] = 0;
+		}
+	}
+	for(int i = 0; i < NINDIRECT + NDINDIRECT; i++){
+		int depth = i < NINDIRECT ? 1 : 2;
+		int span = depth == 1 ? PTRS_PER_BLK : PTRS_PER_BLK*PTRS_PER_BLK;
+		int base = NDIRECT + (i < NINDIRECT ? i*PTRS_PER_BLK : NINDIRECT*PTRS_PER_BLK + (i - NINDIRECT)*span);
+		int blk = inode->indirect_ptr[i];
+		if(blk == 0 || nb >= base + span){
+			continue;
+		}
+		int first = nb > base ? nb - base : 0;
+		bmap_cut(blk, depth, first);
+		if(first == 0){
+			bmap_forget(blk);
+			free_blkno(blk);
+			inode->indirect_ptr[i] = 0;
+		}
+	}
+	__atomic_add_fetch(&bmap_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&bmap_lock);
+	return 0;
+}
+
+/* 
+ * Counter that changes whenever a block that was mapped may have been
+ * unmapped or moved (bmap_set). bmap_set_range only fills holes, so a
+ * mapping looked up earlier stays right while this value is unchanged.
+ */
+unsigned int bmap_generation() {
+	return __atomic_load_n(&bmap_gen, __ATOMIC_ACQUIRE);
+}
+
+/* 
+ * Map the unmapped logical blocks [lb, lb+count) to count disk blocks
+ * starting at blk. Returns how many were mapped (count unless it failed).
+ */
+int bmap_set_range(struct inode *inode, int lb, int blk, int count) {
+	int done = 0;
+	pthread_mutex_lock(&bmap_lock);
+	if(inode->flags & INODE_EXTENTS){
+		done = ext_insert(inode, lb, blk, count) < 0 ? 0 : count;
+	}else{
+		while(done < count && bmap_store(inode, lb + done, blk + done) == 0){
+			done++;
+		}
+	}
+	pthread_mutex_unlock(&bmap_lock);
+	return done;
+}
+
+/* 
+ * Make file system
+ */
+int rufs_mkfs(uint64_t disk_size, uint32_t ninodes, uint32_t blk_size, uint32_t features) {
+
+	// Work out the layout: superblock, inode bitmap, data bitmap, inode table, data
+	// The block size is fixed at compile time, so it can only be checked here
+	if(blk_size != BLOCK_SIZE){
+		fprintf(stderr, "mkfs: block size %u not supported (built for %d)\n", blk_size, BLOCK_SIZE);
+		return -1;
+	}
+	uint64_t nblocks = disk_size / BLOCK_SIZE;
+	uint32_t bits_per_blk = BLOCK_SIZE*8;
+	uint32_t i_bitmap_blks = (ninodes + bits_per_blk - 1) / bits_per_blk;
+	uint32_t d_bitmap_blks = (nblocks + bits_per_blk - 1) / bits_per_blk;
+	uint32_t i_table_blks = (ninodes + inodes_per_block - 1) / inodes_per_block;
+	uint64_t d_start = 1 + i_bitmap_blks + d_bitmap_blks + i_table_blks;
+	if(ninodes == 0 || ninodes > MAX_INUM_LIMIT || nblocks > INT32_MAX || d_start + 1 > nblocks){
+		fprintf(stderr, "mkfs: %u inodes do not fit a %llu byte disk\n",
+				ninodes, (unsigned long long)disk_size);
+		return -1;
+	}
+	// Split the data blocks into allocation groups and share the inodes out
+	// evenly; group sizes are multiples of 64 so each group owns whole bitmap words
+	uint32_t max_dnum = nblocks - d_start;
+	uint32_t group_blks = (max_dnum / GROUP_TARGET + 63) & ~63;
+	if(group_blks < GROUP_MIN_BLKS){
+		group_blks = GROUP_MIN_BLKS;
+	}
+	if(group_blks > GROUP_MAX_BLKS){
+		group_blks = GROUP_MAX_BLKS;
+	}
+	uint32_t ngroups = (max_dnum + group_blks - 1) / group_blks;
+	uint32_t group_inodes = ((ninodes + ngroups - 1) / ngroups + 63) & ~63;
+
+	// Call dev_init() to initialize (Create) Diskfile
+	dev_init_size(diskfile_path, nblocks * BLOCK_SIZE);
+
+	// write superblock information
+	superBlock = bio_alloc();
+	memset(superBlock, 0, BLOCK_SIZE);
+	icache_init();
+	dcache_init();
+	bmap_init();
+	superBlock->magic_num = MAGIC_NUM;
+	superBlock->max_inum = ninodes;
+	superBlock->max_dnum = max_dnum;
+	superBlock->i_bitmap_blk = 1;
+	superBlock->d_bitmap_blk = superBlock->i_bitmap_blk + i_bitmap_blks;
+	superBlock->i_start_blk = superBlock->d_bitmap_blk + d_bitmap_blks;
+	superBlock->d_start_blk = d_start;
+	superBlock->blk_size = BLOCK_SIZE;
+	superBlock->disk_size = nblocks * BLOCK_SIZE;
+	superBlock->features = features;
+	superBlock->group_inodes = group_inodes;
+	superBlock->group_blks = group_blks;
+
+	if(bio_write(super_num, (void *)superBlock) < 0){
+
+		printf("SuperBlock Write Failed");
+	}
+	// initialize inode and data block bitmaps; every bitmap block gets written
+	bitmaps_alloc();
+	memset(inodeBitmapDirty, 1, i_bitmap_blks);
+	memset(dataBitmapDirty, 1, d_bitmap_blks);
+	groups_init();
+
+	// initialize root directory
+	struct inode *root = (struct inode*)calloc(1, sizeof(struct inode));
+	root->ino = root_ino;
+	root->valid = 1;
+	root->size = BLOCK_SIZE;
+	root->type = DIR_TYPE;
+	root->link = 2;
+	root->vstat.st_ino = root_ino;
+	root->vstat.st_mode = S_IFDIR | 0755;
+	root->vstat.st_nlink = 2;
+	root->vstat.st_uid = getuid();
+	root->vstat.st_gid = getgid();
+	root->vstat.st_blksize = BLOCK_SIZE;
+	time(&root->vstat.st_mtime);
+	root->vstat.st_atime = root->vstat.st_ctime = root->vstat.st_mtime;
+
+	alloc_near(root_ino);
+	int block = get_avail_blkno();
+	// start from an empty block, whatever the disk file held there before
+	void* dirBlock = bio_alloc();
+	memset(dirBlock, 0, BLOCK_SIZE);
+	bio_write(block,dirBlock);
+	root->direct_ptr[0] = block;
+	writei(root->ino,root);
+
+
+
+//SET UP ROOT DIRECTORY ENTRIES NEEDED HERE
+
+	dir_add(*root, root_ino, ".", 1);
+	dir_add(*root, root_ino, "..", 2);
+
+	// update bitmap information for root directory
+	// (get_avail_blkno() already marked the root's data block as used)
+	set_bitmap(inodeBitmap,root_ino);
+	bitmap_dirty(inodeBitmapDirty,root_ino);
+	groups[ino_group(root_ino)].ino_free--;
+	bitmaps_flush();
+	// update inode for root directory
+	writei(root->ino,root);
+	free(root);
+	bio_free(dirBlock);
+	return 0;
+}
+
+
+/* 
+ * FUSE file operations
+ */
+static int file_writeback_all();
+static int open_file_new(int ino, struct fuse_file_info *fi);
+
+//Feature flags asked for on the command line for a new disk
+static uint32_t mkfs_features() {
+	return (rufs_opts.compact_dirs ? FEATURE_COMPACT_DIRENT : 0) |
+			(rufs_opts.extents ? FEATURE_EXTENTS : 0);
+}
+
+/*
+ * Connection settings asked of the kernel: writes of up to a full write
+ * buffer (WB_MAX_PAGES blocks) and readahead up to the prefetch window
+ * (RA_MAX_BLKS blocks). libfuse clamps both to what the kernel allows.
+ */
+#define CONN_MAX_WRITE		(256*BLOCK_SIZE)
+#define CONN_MAX_READAHEAD	(64*BLOCK_SIZE)
+
+//Turn on the FUSE features RUFS can use, where the kernel offers them
+static void conn_negotiate(struct fuse_conn_info *conn) {
+	unsigned int want = 0;
+
+	// reads run in parallel under a shared inode lock
+#ifdef FUSE_CAP_ASYNC_READ
+	want |= FUSE_CAP_ASYNC_READ;
+#endif
+#if FUSE_VERSION < 30
+	conn->async_read = 1;
+#endif
+	// one write request can fill many blocks (always on in FUSE 3)
+#ifdef FUSE_CAP_BIG_WRITES
+	want |= FUSE_CAP_BIG_WRITES;
+#endif
+	// write_buf takes request data from a pipe, read_buf replies from the disk file
+#ifdef FUSE_CAP_SPLICE_READ
+	want |= FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE;
+#endif
+	// let the kernel gather small writes in its page cache and send them in bulk
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+	want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif
+	// want and capable came with FUSE 2.8; before that there are no flags to set
+#if FUSE_VERSION >= 28
+	conn->want |= want & conn->capable;
+#else
+	(void)want;
+#endif
+	conn->max_write = CONN_MAX_WRITE;
+	if(conn->max_readahead > CONN_MAX_READAHEAD){
+		conn->max_readahead = CONN_MAX_READAHEAD;
+	}
+}
+
+static void *rufs_init(struct fuse_conn_info *conn) {
+
+	// Step 0: Negotiate what the kernel and RUFS will use on this mount
+	conn_negotiate(conn);
+
+	// Step 1a: If disk file is not found, call mkfs; a disk file that is
+	// there but cannot be opened or mapped is left alone
+	if(dev_open(diskfile_path) < 0){
+		if(errno != ENOENT){
+			fprintf(stderr, "%s: disk file could not be opened, not mounting\n", diskfile_path);
+			exit(EXIT_FAILURE);
+		}
+		if(rufs_mkfs(rufs_opts.disk_size, rufs_opts.inodes, BLOCK_SIZE, mkfs_features()) < 0){
+			exit(EXIT_FAILURE);
+		}
+		return NULL;
+	}
+
+  // Step 1b: If disk file is found, just initialize in-memory data structures
+  // and read superblock from disk
+	superBlock = bio_alloc();
+	// (rufs_parse_opts() already turned away disks that are not RUFS, this
+	// only catches a disk file that changed since)
+	if(bio_read(super_num,superBlock) < 0 || superBlock->magic_num != MAGIC_NUM ||
+			superBlock->blk_size != BLOCK_SIZE){
+		fprintf(stderr, "%s: super block could not be read, not mounting\n", diskfile_path);
+		bio_free(superBlock);
+		dev_close();
+		exit(EXIT_FAILURE);
+	}
+	bitmaps_load();
+	icache_init();
+	dcache_init();
+	bmap_init();
+
+	return NULL;
+}
+
+static void rufs_destroy(void *userdata) {
+
+	// Step 1: De-allocate in-memory data structures
+	file_writeback_all();
+	icache_flush();
+	bitmaps_flush();
+	free(inodeBitmap);
+	free(dataBlockBitmap);
+	free(inodeBitmapDirty);
+	free(dataBitmapDirty);
+	inodeBitmap = NULL;
+	dataBlockBitmap = NULL;
+	inodeBitmapDirty = NULL;
+	dataBitmapDirty = NULL;
+	groups_destroy();
+	bio_free(superBlock);
+	superBlock = NULL;
+	bmap_destroy();
+
+	// Step 2: Close diskfile (dev_close writes back the block cache first)
+	dev_close();
+}
+
+//Fill stbuf with the attributes of inode
+static void inode_stat(const struct inode *inode, struct stat *stbuf) {
+	memcpy(stbuf, &inode->vstat, sizeof(struct stat));
+	// disks made by older versions of mkfs have a blank stat for the root
+	if((stbuf->st_mode & S_IFMT) == 0){
+		stbuf->st_mode = inode->type == FILE_TYPE ? S_IFREG | 0644 : S_IFDIR | 0755;
+	}
+	stbuf->st_ino = inode->ino;
+	stbuf->st_nlink = inode->link;
+	stbuf->st_size = inode->size;
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_blocks = ((blkcnt_t)inode->size + BLOCK_SIZE - 1)/BLOCK_SIZE*(BLOCK_SIZE/512);
+}
+
+/*
+ * Make a regular file called name in directory parent, owned by uid and
+ * gid, and fill in its inode. Returns 0 or -errno.
+ */
+static int file_create(struct inode *parent, const char *name, size_t len, mode_t mode, uid_t uid, gid_t gid, struct inode *inode) {
+	if(parent->type == FILE_TYPE){
+		return -ENOTDIR;
+	}
+	if(len >= sizeof(((struct dirent *)0)->name)){
+		return -ENAMETOOLONG;
+	}
+
+	// Step 3: Call get_avail_ino_near() to get an available inode number near the parent
+	int ino = get_avail_ino_near(parent->ino);
+	if(ino < 0){
+		return -ENOSPC;
+	}
+
+	// Step 4: Update inode for target file and call writei() before it is reachable
+	memset(inode, 0, sizeof(*inode));
+	inode->ino = ino;
+	inode->valid = 1;
+	inode->type = FILE_TYPE;
+	inode->link = 1;
+	bmap_format(inode);
+	inode->vstat.st_ino = ino;
+	inode->vstat.st_mode = S_IFREG | (mode & 07777);
+	inode->vstat.st_nlink = 1;
+	inode->vstat.st_uid = uid;
+	inode->vstat.st_gid = gid;
+	inode->vstat.st_blksize = BLOCK_SIZE;
+	time(&inode->vstat.st_mtime);
+	inode->vstat.st_atime = inode->vstat.st_ctime = inode->vstat.st_mtime;
+	writei(ino, inode);
+
+	// Step 5: Call dir_add() to add directory entry of target file to parent directory
+	// (it fails if the name is taken, including by a racing create)
+	if(dir_add(*parent, ino, name, len) < 0){
+		struct dirent ent;
+		int ret = dir_find(parent->ino, name, len, &ent) == 0 ? -EEXIST : -ENOSPC;
+		inode->valid = 0;
+		writei(ino, inode);
+		free_ino(ino);
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Directory listings
+ *
+ * Listings resume: each entry goes out with the dir_foreach() cursor just
+ * past it as its offset, so a listing continued at that offset picks up
+ * where the last one stopped instead of scanning from the top. Entries
+ * are read DIR_BATCH at a time and their inodes fetched together by
+ * readi_many(), which reads inode-table blocks in bulk; that gives
+ * readdir each entry's type and readdirplus its attributes. An entry
+ * removed mid-listing is not listed after that and an entry added may or
+ * may not be; every other entry is listed exactly once.
+ */
+#define DIR_BATCH	64
+
+struct dir_batch {
+	int n;
+	struct dirent ents[DIR_BATCH];
+	off_t next[DIR_BATCH];			/* cursor past each entry */
+	struct inode inodes[DIR_BATCH];
+};
+
+static int dir_batch_add(void *arg, const struct dirent *ent, off_t next) {
+	struct dir_batch *b = arg;
+	memcpy(&b->ents[b->n], ent, sizeof(*ent));
+	b->next[b->n] = next;
+	return ++b->n == DIR_BATCH;
+}
+
+//Read up to DIR_BATCH entries of directory ino from cursor off, with their inodes
+static int dir_batch_read(uint16_t ino, off_t off, struct dir_batch *b) {
+	uint16_t inos[DIR_BATCH];
+
+	b->n = 0;
+	if(dir_foreach(ino, off, dir_batch_add, b) < 0){
+		return -1;
+	}
+	for(int i = 0; i < b->n; i++){
+		inos[i] = b->ents[i].ino;
+	}
+	readi_many(b->n, inos, b->inodes);
+	return b->n;
+}
+
+#ifndef RUFS_LOWLEVEL
+static int rufs_getattr(const char *path, struct stat *stbuf) {
+
+	// Step 1: call get_node_by_path() to get inode from path
+	struct inode inode;
+	int ret = get_node_by_path(path, root_ino, &inode);
+	if(ret < 0){
+		return ret;
+	}
+
+	// Step 2: fill attribute of file into stbuf from inode
+	inode_stat(&inode, stbuf);
+	return 0;
+}
+
+static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+
+	// Step 2: If not find, return -1
+
+    return 0;
+}
+
+static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode inode;
+	int ret = get_node_by_path(path, root_ino, &inode);
+	if(ret < 0){
+		return ret;
+	}
+	if(inode.type == FILE_TYPE){
+		return -ENOTDIR;
+	}
+
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	// a batch at a time from offset on, until filler's buffer is full
+	struct dir_batch *b = malloc(sizeof(*b));
+	if(b == NULL){
+		return -ENOMEM;
+	}
+	int full = 0;
+	do{
+		if(dir_batch_read(inode.ino, offset, b) < 0){
+			free(b);
+			return -EIO;
+		}
+		for(int i = 0; i < b->n && !full; i++){
+			struct stat st;
+			inode_stat(&b->inodes[i], &st);
+			st.st_ino = b->ents[i].ino;
+			if(filler(buffer, b->ents[i].name, &st, b->next[i]) != 0){
+				full = 1;
+			}else{
+				offset = b->next[i];
+			}
+		}
+	}while(!full && b->n == DIR_BATCH);
+	free(b);
+	return 0;
+}
+
+
+static int rufs_mkdir(const char *path, mode_t mode) {
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+
+	// Step 3: Call get_avail_ino() to get an available inode number
+
+	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
+
+	// Step 5: Update inode for target directory
+
+	// Step 6: Call writei() to write inode to disk
+	
+
+	return 0;
+}
+
+static int rufs_rmdir(const char *path) {
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+
+	// Step 2: Call get_node_by_path() to get inode of target directory
+
+	// Step 3: Clear data block bitmap of target directory
+
+	// Step 4: Clear inode bitmap and its data block
+
+	// Step 5: Call get_node_by_path() to get inode of parent directory
+
+	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
+
+	return 0;
+}
+
+static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
+
+static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	char *dcopy = strdup(path), *bcopy = strdup(path);
+	if(dcopy == NULL || bcopy == NULL){
+		free(dcopy);
+		free(bcopy);
+		return -ENOMEM;
+	}
+	const char *dir = dirname(dcopy), *name = basename(bcopy);
+	size_t len = strlen(name);
+	int ret = 0;
+
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	struct inode parent, inode;
+	ret = get_node_by_path(dir, root_ino, &parent);
+	if(ret < 0){
+		goto out;
+	}
+	ret = file_create(&parent, name, len, mode, fuse_get_context()->uid, fuse_get_context()->gid, &inode);
+	if(ret < 0){
+		goto out;
+	}
+
+	// Step 6: Open the new file
+	ret = open_file_new(inode.ino, fi);
+out:
+	free(dcopy);
+	free(bcopy);
+	return ret;
+}
+#endif
+
+/*
+ * Open files
+ *
+ * rufs_open and rufs_create resolve the path once and hand FUSE an
+ * open_file through fi->fh. It keeps the inode pinned in the inode cache
+ * while the file is open, so read, write, flush and release go straight
+ * to it. It also carries the handle's readahead state and the last block
+ * run its reads mapped, which spares sequential reads the block map walk
+ * for every block. Without a handle (fi or fi->fh unset) the path is
+ * resolved as before.
+ */
+struct open_file {
+	struct inode *ip;			/* pinned until rufs_release */
+	int ino;
+	pthread_mutex_t lock;		/* reads through one handle can run concurrently */
+	off_t ra_pos;				/* where a sequential reader continues */
+	int ra_end;					/* first block past the prefetched window */
+	int ra_size;				/* readahead window in blocks, 0 when not streaming */
+	int map_lb, map_blk, map_len;	/* logical blocks [map_lb, +map_len) start at disk block map_blk */
+	unsigned int map_gen;		/* bmap_generation() the run was found under */
+};
+
+//Readahead window limits, in blocks
+#define RA_MIN_BLKS	4
+#define RA_MAX_BLKS	64
+
+static struct open_file *open_file_get(struct fuse_file_info *fi) {
+	return fi != NULL ? (struct open_file *)(uintptr_t)fi->fh : NULL;
+}
+
+//Make a handle for inode ino and store it in fi->fh
+static int open_file_new(int ino, struct fuse_file_info *fi) {
+	struct open_file *of = calloc(1, sizeof(*of));
+	if(of == NULL){
+		return -ENOMEM;
+	}
+	of->ino = ino;
+	of->ip = iget(ino);
+	if(of->ip == NULL){
+		free(of);
+		return -ENFILE;
+	}
+	// a file unlinked since its path was looked up is gone
+	struct inode inode;
+	ilock(of->ip, 1);
+	readi(ino, &inode);
+	if(!inode.valid || inode.link == 0){
+		iunlock(of->ip);
+		iput(of->ip);
+		free(of);
+		return -ENOENT;
+	}
+	((struct icache_entry *)of->ip)->nopen++;
+	iunlock(of->ip);
+	pthread_mutex_init(&of->lock, NULL);
+	fi->fh = (uintptr_t)of;
+	// Only this mount changes the file, so the kernel's cached pages stay valid
+	fi->keep_cache = 1;
+	return 0;
+}
+
+#ifndef RUFS_LOWLEVEL
+static int rufs_open(const char *path, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode inode;
+	int ret = get_node_by_path(path, root_ino, &inode);
+	if(ret < 0){
+		// Step 2: If not find, return -1
+		return ret;
+	}
+
+	// Keep the inode pinned in the inode cache while the file is open
+	return open_file_new(inode.ino, fi);
+}
+#endif
+
+/*
+ * bmap_extent() through a handle: a block inside the run the handle last
+ * mapped is worked out without a lookup
+ */
+static int file_bmap(struct open_file *of, struct inode *inode, int lb, int *len) {
+	if(of != NULL){
+		pthread_mutex_lock(&of->lock);
+		if(of->map_gen == bmap_generation() && lb >= of->map_lb && lb < of->map_lb + of->map_len){
+			int blk = of->map_blk + (lb - of->map_lb);
+			*len = of->map_lb + of->map_len - lb;
+			pthread_mutex_unlock(&of->lock);
+			return blk;
+		}
+		pthread_mutex_unlock(&of->lock);
+	}
+	return bmap_extent(inode, lb, len);
+}
+
+/*
+ * Number of logical blocks from lb on (at most max) whose data blocks are
+ * physically adjacent on disk, so they can move in one vectored transfer.
+ * The run found is remembered in the handle, if there is one.
+ */
+static int file_run(struct open_file *of, struct inode *inode, int lb, int max) {
+	int len;
+	int start = file_bmap(of, inode, lb, &len);
+	int n = len < max ? len : max;
+	while(n < max && bmap(inode, lb + n) == start + n){
+		n++;
+	}
+	if(of != NULL && n > len){
+		pthread_mutex_lock(&of->lock);
+		of->map_lb = lb;
+		of->map_blk = start;
+		of->map_len = n;
+		of->map_gen = bmap_generation();
+		pthread_mutex_unlock(&of->lock);
+	}
+	return n;
+}
+
+/*
+ * Lock the file at path, or the one open through of (shared to read,
+ * exclusive to write), and fill in a current copy of its inode.
+ * A file found by path is pinned as well; file_unlock() undoes both.
+ */
+static struct inode *file_lock(const char *path, struct open_file *of, int write, struct inode *inode) {
+	struct inode *ip;
+	if(of != NULL){
+		ip = of->ip;
+		inode->ino = of->ino;
+	}else{
+		if(get_node_by_path(path, root_ino, inode) < 0){
+			return NULL;
+		}
+		ip = iget(inode->ino);
+		if(ip == NULL){
+			return NULL;
+		}
+	}
+	ilock(ip, write);
+	readi(inode->ino, inode);
+	return ip;
+}
+
+static void file_unlock(struct inode *ip, struct open_file *of) {
+	iunlock(ip);
+	if(of == NULL){
+		iput(ip);
+	}
+}
+
+//Read from a file whose inode lock is held (through handle of, if not NULL)
+static int file_read(struct open_file *of, struct inode *ip, struct inode *inode, char *buffer, size_t size, off_t offset) {
+	struct wbuf *wb = iwbuf(ip);
+	if(offset >= inode->size){
+		return 0;
+	}
+	if(offset + size > inode->size){
+		size = inode->size - offset;
+	}
+
+	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 3: copy the correct amount of data from offset to buffer
+	// Whole blocks that are adjacent on disk are read straight into buffer
+	char *tmp = NULL;
+	size_t done = 0;
+	while(done < size){
+		int lb = (offset + done)/BLOCK_SIZE;
+		size_t boff = (offset + done)%BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - boff;
+		if(n > size - done){
+			n = size - done;
+		}
+		// pages not written back yet are newer than the disk
+		struct wpage *pg = wbuf_find(wb, lb);
+		int len, blk = pg != NULL ? 0 : file_bmap(of, inode, lb, &len);
+		if(pg != NULL){
+			memcpy(buffer + done, pg->data + boff, n);
+		}else if(blk == 0){
+			memset(buffer + done, 0, n);
+		}else if(n == BLOCK_SIZE){
+			int run = file_run(of, inode, lb, (size - done)/BLOCK_SIZE);
+			int next = wbuf_search(wb, lb);
+			if(next < wb->count && wb->pages[next].lb - lb < run){
+				run = wb->pages[next].lb - lb;
+			}
+			if(bio_read_range(blk, run, buffer + done) < 0){
+				bio_free(tmp);
+				return -EIO;
+			}
+			n = (size_t)run*BLOCK_SIZE;
+		}else{
+			if(tmp == NULL){
+				tmp = bio_alloc();
+			}
+			bio_read(blk, tmp);
+			memcpy(buffer + done, tmp + boff, n);
+		}
+		done += n;
+	}
+	bio_free(tmp);
+
+	// Note: this function should return the amount of bytes you copied to buffer
+	return size;
+}
+
+/*
+ * Readahead
+ *
+ * A read that starts where the previous one through the same handle ended
+ * continues a sequential stream. The first such read opens a window of
+ * RA_MIN_BLKS blocks past itself; whenever the reader comes within half a
+ * window of the prefetched end, the next window is prefetched and the
+ * window doubles, up to RA_MAX_BLKS. A read anywhere else halves the
+ * window and prefetches nothing. Prefetching is asynchronous (see
+ * bio_prefetch), one request per physically contiguous run of the file.
+ */
+static void file_readahead(struct open_file *of, struct inode *inode, off_t offset, size_t size) {
+	if(of == NULL || size == 0 || offset >= inode->size){
+		return;
+	}
+	int last = (offset + size - 1)/BLOCK_SIZE;
+	int eof = (inode->size - 1)/BLOCK_SIZE;
+	int from = 0, to = -1;
+
+	// Step 1: Classify the read and move the window
+	pthread_mutex_lock(&of->lock);
+	if(offset == of->ra_pos){
+		if(of->ra_size == 0){
+			of->ra_size = RA_MIN_BLKS;
+		}
+		if(of->ra_end <= last){
+			of->ra_end = last + 1;
+		}
+		if(last + of->ra_size/2 >= of->ra_end){
+			from = of->ra_end;
+			to = from + of->ra_size - 1;
+			of->ra_end = to + 1;
+			if(of->ra_size < RA_MAX_BLKS){
+				of->ra_size *= 2;
+			}
+		}
+	}else{
+		of->ra_size /= 2;
+		if(of->ra_size < RA_MIN_BLKS){
+			of->ra_size = 0;
+		}
+		of->ra_end = 0;
+	}
+	of->ra_pos = offset + size;
+	pthread_mutex_unlock(&of->lock);
+
+	// Step 2: Start reading the window's blocks that lie inside the file
+	if(to > eof){
+		to = eof;
+	}
+	for(int lb = from; lb <= to; ){
+		int len, blk = file_bmap(of, inode, lb, &len);
+		if(blk == 0){
+			lb++;
+			continue;
+		}
+		int run = file_run(of, inode, lb, to - lb + 1);
+		bio_prefetch(blk, run);
+		lb += run;
+	}
+}
+
+#ifndef RUFS_LOWLEVEL
+static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	// Step 1: Use the open file's inode, or call get_node_by_path() without one
+	struct open_file *of = open_file_get(fi);
+	struct inode inode;
+	struct inode *ip = file_lock(path, of, 0, &inode);
+	if(ip == NULL){
+		return -ENOENT;
+	}
+	// Get the next blocks coming while this read waits on its own
+	file_readahead(of, &inode, offset, size);
+	int ret = file_read(of, ip, &inode, buffer, size, offset);
+	file_unlock(ip, of);
+	return ret;
+}
+#endif
+
+#if FUSE_VERSION >= 29
+/*
+ * Zero-copy reads
+ *
+ * read_buf answers with a fuse_bufvec rather than a filled buffer. Every
+ * run of the file that is contiguous on disk becomes one FUSE_BUF_IS_FD
+ * buffer naming the DISKFILE descriptor and the run's offset in it, so
+ * libfuse can splice the data to the kernel without it passing through
+ * our memory. Buffered pages and holes are handed over as memory. When
+ * the descriptor cannot be read directly (O_DIRECT), the data is copied
+ * with file_read() as before. An FD buffer names disk blocks, not data,
+ * so it is only good while the file stays locked: a truncate could free
+ * the blocks and a write reuse them before the splice. The low-level
+ * frontend replies before unlocking; the high-level one, where libfuse
+ * only splices after read_buf returns, gets every run copied to memory.
+ */
+
+//Append an empty buffer to *vec, which has room for *cap of them
+static struct fuse_buf *bufvec_add(struct fuse_bufvec **vec, size_t *cap) {
+	struct fuse_bufvec *v = *vec;
+	if(v->count == *cap){
+		size_t ncap = *cap*2;
+		v = realloc(v, sizeof(*v) + (ncap - 1)*sizeof(struct fuse_buf));
+		if(v == NULL){
+			return NULL;
+		}
+		*vec = v;
+		*cap = ncap;
+	}
+	struct fuse_buf *b = &v->buf[v->count++];
+	memset(b, 0, sizeof(*b));
+	b->fd = -1;
+	return b;
+}
+
+static void bufvec_free(struct fuse_bufvec *vec) {
+	for(size_t i = 0; i < vec->count; i++){
+		if(!(vec->buf[i].flags & FUSE_BUF_IS_FD)){
+			free(vec->buf[i].mem);
+		}
+	}
+	free(vec);
+}
+
+/*
+ * Describe a read of a file whose inode lock is held as buffers; with
+ * use_fd, runs on disk are FD buffers, which the caller must hand on
+ * before unlocking the file
+ */
+static int file_read_buf(struct open_file *of, struct inode *ip, struct inode *inode, struct fuse_bufvec **bufp, size_t size, off_t offset, int use_fd) {
+
+	// Step 1: Clip the read at the end of the file
+	size_t cap = 4;
+	struct fuse_bufvec *vec = malloc(sizeof(*vec) + (cap - 1)*sizeof(struct fuse_buf));
+	if(vec == NULL){
+		return -ENOMEM;
+	}
+	*vec = FUSE_BUFVEC_INIT(0);
+	vec->count = 0;
+	if(offset >= inode->size){
+		size = 0;
+	}else if(offset + size > inode->size){
+		size = inode->size - offset;
+	}
+	file_readahead(of, inode, offset, size);
+
+	// Step 2: Describe the range run by run
+	struct wbuf *wb = iwbuf(ip);
+	int ret = 0;
+	size_t done = 0;
+	while(done < size){
+		off_t pos = offset + done;
+		int lb = pos/BLOCK_SIZE;
+		size_t boff = pos%BLOCK_SIZE;
+		// without FD buffers the whole read is copied in one go
+		size_t n = use_fd ? BLOCK_SIZE - boff : size - done;
+		int fd = -1, run = 0;
+		int len, blk = !use_fd || wbuf_find(wb, lb) != NULL ? 0 : file_bmap(of, inode, lb, &len);
+		if(blk != 0){
+			run = file_run(of, inode, lb, (boff + size - done + BLOCK_SIZE - 1)/BLOCK_SIZE);
+			int next = wbuf_search(wb, lb);
+			if(next < wb->count && wb->pages[next].lb - lb < run){
+				run = wb->pages[next].lb - lb;
+			}
+			fd = bio_fd_range(blk, run);
+			n = (size_t)run*BLOCK_SIZE - boff;
+		}
+		if(n > size - done){
+			n = size - done;
+		}
+		struct fuse_buf *b = bufvec_add(&vec, &cap);
+		if(b == NULL){
+			ret = -ENOMEM;
+			break;
+		}
+		b->size = n;
+		if(fd >= 0){
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			b->fd = fd;
+			b->pos = (off_t)blk*BLOCK_SIZE + boff;
+		}else{
+			// a buffered page, a hole, or blocks only file_read can reach
+			b->mem = malloc(n);
+			if(b->mem == NULL){
+				ret = -ENOMEM;
+				break;
+			}
+			if(file_read(of, ip, inode, b->mem, n, pos) < 0){
+				ret = -EIO;
+				break;
+			}
+		}
+		done += n;
+	}
+	if(ret < 0){
+		bufvec_free(vec);
+		return ret;
+	}
+	if(vec->count == 0){
+		*vec = FUSE_BUFVEC_INIT(0);
+	}
+	*bufp = vec;
+	return 0;
+}
+
+#ifndef RUFS_LOWLEVEL
+static int rufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// libfuse splices FD buffers once the file is unlocked again, so the
+	// data is copied while it is still the file's
+	struct open_file *of = open_file_get(fi);
+	struct inode inode;
+	struct inode *ip = file_lock(path, of, 0, &inode);
+	if(ip == NULL){
+		return -ENOENT;
+	}
+	int ret = file_read_buf(of, ip, &inode, bufp, size, offset, 0);
+	file_unlock(ip, of);
+	return ret;
+}
+#endif
+#endif
+
+/*
+ * Give every unmapped logical block in [first, last] a data block.
+ * Runs of missing blocks are allocated as contiguous extents.
+ * Newly mapped blocks are flagged in fresh (indexed from first).
+ */
+static int file_alloc_range(struct inode *inode, int first, int last, char *fresh) {
+	int lb = first;
+	while(lb <= last){
+		if(bmap(inode, lb) != 0){
+			lb++;
+			continue;
+		}
+		// length of the run of unmapped blocks starting at lb
+		int want = 1;
+		while(lb + want <= last && bmap(inode, lb + want) == 0){
+			want++;
+		}
+		int start, len;
+		if(get_avail_extent(want, &start, &len) < 0){
+			return -1;
+		}
+		int mapped = bmap_set_range(inode, lb, start, len);
+		for(int i = 0; i < mapped; i++){
+			fresh[lb + i - first] = 1;
+		}
+		if(mapped < len){
+			for(int i = mapped; i < len; i++){
+				free_blkno(start + i);
+			}
+			return -1;
+		}
+		lb += len;
+	}
+	return 0;
+}
+
+/*
+ * Delayed allocation
+ *
+ * rufs_write copies data into dirty pages kept with the inode in the inode
+ * cache (an inode holding pages stays pinned there). A page over a hole or
+ * past the end of the file reserves a data block rather than allocating
+ * one. file_writeback() later maps all of a file's new pages at once, so
+ * each run of them comes out of one contiguous extent, and writes every
+ * physically contiguous run of pages with a single vectored write. This
+ * happens when the file is flushed or released, when its buffer reaches
+ * WB_MAX_PAGES pages, and at unmount.
+ *
+ * Mapping the pages can also allocate pointer blocks or extent tree nodes,
+ * so the buffer holds a reservation (wb->meta) for the most of those its
+ * reserved pages could need, and writeback cannot run out of space for
+ * blocks nobody reserved. When that reservation cannot grow, the write
+ * maps its pages at once instead.
+ */
+#define WB_MAX_PAGES	256
+
+/*
+ * Map blocks that mapping logical blocks lb..lb+n-1 may allocate at worst.
+ * An extent tree may split a node on every level and grow a new root
+ * level, then split another leaf for every half leaf of extents the run
+ * breaks into. A block map needs a pointer block for every PTRS_PER_BLK
+ * blocks the run touches, and in the double-indirect range their parents.
+ */
+static int bmap_meta(struct inode *inode, int lb, int n) {
+	if(inode->flags & INODE_EXTENTS){
+		return ext_root(inode)->depth + 2 + n/(int)(EXT_NODE_MAX/2);
+	}
+	int last = lb + n - 1;
+	if(last < NDIRECT){
+		return 0;
+	}
+	if(lb < NDIRECT){
+		lb = NDIRECT;
+	}
+	int spans = (last - NDIRECT)/PTRS_PER_BLK - (lb - NDIRECT)/PTRS_PER_BLK + 1;
+	if(last < NDIRECT + NINDIRECT*PTRS_PER_BLK){
+		return spans;
+	}
+	return 2*spans + NDINDIRECT;
+}
+
+//Map blocks the reserved pages of ip may need at writeback (see bmap_meta)
+static int wbuf_meta(struct inode *ip, struct inode *inode) {
+	struct wbuf *wb = iwbuf(ip);
+	int meta = 0;
+	for(int i = 0; i < wb->count; ){
+		if(!wb->pages[i].reserved){
+			i++;
+			continue;
+		}
+		int lb = wb->pages[i].lb, n = 1;
+		while(i + n < wb->count && wb->pages[i + n].reserved && wb->pages[i + n].lb == lb + n){
+			n++;
+		}
+		meta += bmap_meta(inode, lb, n);
+		i += n;
+	}
+	return meta;
+}
+
+/*
+ * Bring the map block reservation of ip to what its reserved pages need,
+ * on top of extra blocks the caller reserved for it; -1 if it has to grow
+ * and the disk cannot cover that
+ */
+static int wbuf_meta_set(struct inode *ip, struct inode *inode, int extra) {
+	struct wbuf *wb = iwbuf(ip);
+	int held = wb->meta + extra;
+	int meta = wbuf_meta(ip, inode);
+	if(meta > held && blocks_reserve(meta - held) < 0){
+		wb->meta = held;
+		return -1;
+	}
+	if(meta < held){
+		blocks_unreserve(held - meta);
+	}
+	wb->meta = meta;
+	return 0;
+}
+
+/*
+ * Write the buffered pages of a file to disk; the inode lock is held
+ * exclusively and inode is the caller's current copy
+ */
+static int file_writeback(struct inode *ip, struct inode *inode) {
+	struct wbuf *wb = iwbuf(ip);
+	int ret = 0, mapped = 0;
+
+	if(wb->count == 0){
+		return 0;
+	}
+	const void **bufs = malloc(wb->count*sizeof(*bufs));
+	char *fresh = malloc(wb->count);
+	if(bufs == NULL || fresh == NULL){
+		free(bufs);
+		free(fresh);
+		return -ENOMEM;
+	}
+
+	// Step 1: Allocate each run of consecutive reserved pages in one go
+	alloc_near(inode->ino);
+	for(int i = 0; i < wb->count; ){
+		if(!wb->pages[i].reserved){
+			i++;
+			continue;
+		}
+		int lb = wb->pages[i].lb, n = 1;
+		while(i + n < wb->count && wb->pages[i + n].reserved && wb->pages[i + n].lb == lb + n){
+			n++;
+		}
+		memset(fresh, 0, n);
+		if(file_alloc_range(inode, lb, lb + n - 1, fresh) < 0){
+			// unmap from the end so extents shrink rather than split
+			for(int k = n - 1; k >= 0; k--){
+				if(fresh[k]){
+					free_blkno(bmap(inode, lb + k));
+					bmap_set(inode, lb + k, 0);
+				}
+			}
+			ret = -ENOSPC;
+			break;
+		}
+		for(int k = 0; k < n; k++){
+			wb->pages[i + k].reserved = 0;
+		}
+		mapped += n;
+		i += n;
+	}
+	blocks_unreserve(mapped);
+	if(wb->meta > 0){
+		wbuf_meta_set(ip, inode, 0);
+	}
+
+	// Step 2: Write each run of pages that is contiguous on disk at once
+	for(int i = 0; i < wb->count && ret == 0; ){
+		int lb = wb->pages[i].lb;
+		int blk = bmap(inode, lb);
+		int n = 0;
+		while(i + n < wb->count && wb->pages[i + n].lb == lb + n && bmap(inode, lb + n) == blk + n){
+			bufs[n] = wb->pages[i + n].data;
+			n++;
+		}
+		if(bio_writev(blk, n, bufs) < 0){
+			ret = -EIO;
+		}
+		i += n;
+	}
+	free(bufs);
+	free(fresh);
+
+	// Step 3: Drop the pages once they are on disk and save the block map
+	if(ret == 0){
+		wbuf_clear(ip);
+	}
+	writei(inode->ino, inode);
+	return ret;
+}
+
+//Write back the buffered pages of every inode that has some
+static int file_writeback_all() {
+	int inos[ICACHE_SIZE], n = 0, ret = 0;
+
+	pthread_mutex_lock(&icache_lock);
+	for(int i = 0; i < ICACHE_SIZE; i++){
+		if(icache[i].ino >= 0 && icache[i].wb_pinned){
+			inos[n++] = icache[i].ino;
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	for(int i = 0; i < n; i++){
+		struct inode inode;
+		struct inode *ip = iget(inos[i]);
+		if(ip == NULL){
+			continue;
+		}
+		ilock(ip, 1);
+		readi(inos[i], &inode);
+		if(file_writeback(ip, &inode) < 0){
+			ret = -1;
+		}
+		iunlock(ip);
+		iput(ip);
+	}
+	return ret;
+}
+
+//Write to a file whose inode lock is held exclusively
+static int file_write(struct inode *ip, struct inode *inode, const char *buffer, size_t size, off_t offset) {
+	struct wbuf *wb = iwbuf(ip);
+	int ret = 0;
+
+	if(size == 0){
+		return 0;
+	}
+	// inode->size is 32 bits wide, which is below what the block map reaches
+	if(offset + size > UINT32_MAX){
+		return -EFBIG;
+	}
+	if(inode->size == 0){
+		bmap_format(inode);
+	}
+
+	// Step 2: Reserve a data block for every page that will need a new one,
+	// and the map blocks each run of those pages may need
+	int first = offset/BLOCK_SIZE;
+	int last = (offset + size - 1)/BLOCK_SIZE;
+	int need = 0, meta = 0;
+	for(int lb = first; lb <= last; ){
+		int n = 0;
+		while(lb + n <= last && wbuf_find(wb, lb + n) == NULL && bmap(inode, lb + n) == 0){
+			n++;
+		}
+		if(n > 0){
+			need += n;
+			meta += bmap_meta(inode, lb, n);
+			lb += n;
+		}else{
+			lb++;
+		}
+	}
+	if(need > 0 && blocks_reserve(need + meta) < 0){
+		// mapping what is buffered gives back its map block reservation
+		if(wb->meta == 0 || file_writeback(ip, inode) < 0 || blocks_reserve(need + meta) < 0){
+			return -ENOSPC;
+		}
+	}
+
+	// Step 3: Copy the data into the file's dirty pages
+	size_t done = 0;
+	while(done < size){
+		int lb = (offset + done)/BLOCK_SIZE;
+		size_t boff = (offset + done)%BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - boff;
+		if(n > size - done){
+			n = size - done;
+		}
+		struct wpage *pg = wbuf_find(wb, lb);
+		if(pg == NULL){
+			if(wb->count >= WB_MAX_PAGES && (ret = file_writeback(ip, inode)) < 0){
+				break;
+			}
+			int blk = bmap(inode, lb);
+			if((pg = wbuf_add(ip, lb)) == NULL){
+				ret = -ENOMEM;
+				break;
+			}
+			if(blk == 0){
+				pg->reserved = 1;
+				need--;
+			}
+			// a page the write only covers part of starts from the current data
+			if(n < BLOCK_SIZE){
+				if(blk == 0){
+					memset(pg->data, 0, BLOCK_SIZE);
+				}else{
+					bio_read(blk, pg->data);
+				}
+			}
+		}
+		memcpy(pg->data + boff, buffer + done, n);
+		done += n;
+	}
+	blocks_unreserve(need);
+	// keep only what the buffer now needs; a write back in between can have
+	// deepened the tree, and if that cannot be covered map the pages now
+	if(wbuf_meta_set(ip, inode, meta) < 0){
+		int err = file_writeback(ip, inode);
+		if(err < 0 && done == 0){
+			ret = err;
+		}
+	}
+	if(done == 0){
+		return ret;
+	}
 
-	// Step 4: Clear inode bitmap and its data block
+	// Step 4: Update the inode info; it reaches the disk with the pages
+	if(offset + done > inode->size){
+		inode->size = offset + done;
+		inode->vstat.st_size = inode->size;
+	}
+	time(&inode->vstat.st_mtime);
+	writei(inode->ino, inode);
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
+	// Note: this function should return the amount of bytes you write to disk
+	return done;
+}
 
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
+/*
+ * Set the size of a file whose inode lock is held exclusively. Shrinking
+ * drops the buffered pages and frees the blocks past the new end and
+ * zeroes the rest of the last block, so growing the file again later
+ * reads zeros there; growing leaves a hole.
+ */
+static int file_truncate(struct inode *ip, struct inode *inode, off_t size) {
+	if(size < 0){
+		return -EINVAL;
+	}
+	if(size > UINT32_MAX){
+		return -EFBIG;
+	}
+	if(size < inode->size){
+		int nb = (size + BLOCK_SIZE - 1)/BLOCK_SIZE;
+
+		// Step 1: Drop the pages past the end and free their blocks
+		wbuf_drop(ip, nb, INT_MAX);
+		wbuf_meta_set(ip, inode, 0);
+		bmap_truncate(inode, nb);
+
+		// Step 2: Zero the last block past the new end
+		if(size%BLOCK_SIZE != 0){
+			struct wpage *pg = wbuf_find(iwbuf(ip), nb - 1);
+			int blk = bmap(inode, nb - 1);
+			if(pg != NULL){
+				memset(pg->data + size%BLOCK_SIZE, 0, BLOCK_SIZE - size%BLOCK_SIZE);
+			}else if(blk != 0){
+				char *data = bio_alloc();
+				if(bio_read(blk, data) < 0){
+					bio_free(data);
+					return -EIO;
+				}
+				memset(data + size%BLOCK_SIZE, 0, BLOCK_SIZE - size%BLOCK_SIZE);
+				bio_write(blk, data);
+				bio_free(data);
+			}
+		}
+	}
 
+	// Step 3: Update the inode info
+	inode->size = size;
+	inode->vstat.st_size = size;
+	time(&inode->vstat.st_mtime);
+	inode->vstat.st_ctime = inode->vstat.st_mtime;
+	writei(inode->ino, inode);
 	return 0;
 }
 
-static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+/*
+ * Free the data of a file with no links or open handles left, whose inode
+ * lock is held exclusively, and mark its inode unused. The caller frees the
+ * inode number once the lock is dropped.
+ */
+static void file_free(struct inode *ip, struct inode *inode) {
+	wbuf_drop(ip, 0, INT_MAX);
+	wbuf_meta_set(ip, inode, 0);
+	bmap_truncate(inode, 0);
+	inode->size = 0;
+	inode->vstat.st_size = 0;
+	inode->valid = 0;
+	writei(inode->ino, inode);
 }
 
-static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-
-	// Step 3: Call get_avail_ino() to get an available inode number
-
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-
-	// Step 5: Update inode for target file
-
-	// Step 6: Call writei() to write inode to disk
-
-	return 0;
+#ifndef RUFS_LOWLEVEL
+static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// Step 1: Use the open file's inode, or call get_node_by_path() without one
+	struct open_file *of = open_file_get(fi);
+	struct inode inode;
+	struct inode *ip = file_lock(path, of, 1, &inode);
+	if(ip == NULL){
+		return -ENOENT;
+	}
+	int ret = file_write(ip, &inode, buffer, size, offset);
+	file_unlock(ip, of);
+	return ret;
 }
+#endif
 
-static int rufs_open(const char *path, struct fuse_file_info *fi) {
-
-	// Step 1: Call get_node_by_path() to get inode from path
-
-	// Step 2: If not find, return -1
+#if FUSE_VERSION >= 29
+/*
+ * Spliced writes
+ *
+ * write_buf receives the data as a fuse_bufvec, which may still be a pipe
+ * the kernel filled. A write that covers whole blocks is mapped at once
+ * (missing blocks come from contiguous extents, as at writeback) and each
+ * run of blocks that is contiguous on disk is copied straight into the
+ * DISKFILE descriptor with fuse_buf_copy(), letting libfuse splice from the
+ * pipe. Buffered pages it covers are simply dropped. Any other write is
+ * gathered into memory and goes through the buffered path of file_write.
+ */
 
-	return 0;
-}
+//Write whole blocks from buf into a file whose inode lock is held exclusively
+static int file_write_fd(struct open_file *of, struct inode *ip, struct inode *inode, struct fuse_bufvec *buf, off_t offset) {
+	struct wbuf *wb = iwbuf(ip);
+	size_t size = fuse_buf_size(buf);
+	int ret = 0;
 
-static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if(offset + size > UINT32_MAX){
+		return -EFBIG;
+	}
+	if(inode->size == 0){
+		bmap_format(inode);
+	}
 
-	// Step 1: You could call get_node_by_path() to get inode from path
+	// Step 1: Map every block of the range; buffered pages bring their reservation
+	int first = offset/BLOCK_SIZE;
+	int last = first + size/BLOCK_SIZE - 1;
+	int need = 0;
+	for(int lb = first; lb <= last; lb++){
+		struct wpage *pg = wbuf_find(wb, lb);
+		if(bmap(inode, lb) == 0 && (pg == NULL || !pg->reserved)){
+			need++;
+		}
+	}
+	if(need > 0 && blocks_reserve(need) < 0){
+		return -ENOSPC;
+	}
+	char *fresh = calloc(last - first + 1, 1);
+	if(fresh == NULL){
+		blocks_unreserve(need);
+		return -ENOMEM;
+	}
+	alloc_near(inode->ino);
+	if(file_alloc_range(inode, first, last, fresh) < 0){
+		ret = -ENOSPC;
+	}
+	blocks_unreserve(need);
+
+	// Step 2: Copy each contiguous run of blocks into the disk file
+	size_t done = 0;
+	for(int lb = first; lb <= last && ret == 0; ){
+		int len, blk = file_bmap(of, inode, lb, &len);
+		int run = file_run(of, inode, lb, last - lb + 1);
+		int fd = bio_fd_range(blk, run);
+		if(fd < 0){
+			ret = -EIO;
+			break;
+		}
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t)run*BLOCK_SIZE);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fd;
+		dst.buf[0].pos = (off_t)blk*BLOCK_SIZE;
+		ssize_t n = fuse_buf_copy(&dst, buf, 0);
+		bio_invalidate(blk, run);
+		if(n < 0){
+			ret = n;
+			break;
+		}
+		done += n;
+		if(n < (ssize_t)run*BLOCK_SIZE){
+			break;
+		}
+		lb += run;
+	}
+	// only whole blocks count as written: a buffered page of a block the copy
+	// stopped in is newer than the disk and must not lose the rest of it
+	done -= done%BLOCK_SIZE;
+	if(done == 0 && ret == 0){
+		ret = -EIO;
+	}
 
-	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 3: Pages of the blocks written are stale now; later pages stay
+	// buffered, keeping their reservation, and their blocks go back below
+	if(done > 0){
+		wbuf_drop(ip, first, first + done/BLOCK_SIZE - 1);
+		wbuf_meta_set(ip, inode, 0);
+	}
 
-	// Step 3: copy the correct amount of data from offset to buffer
+	// Step 4: Give back new blocks that got no data, from the end so extents shrink
+	for(int lb = last; lb >= first && (size_t)(lb - first)*BLOCK_SIZE >= done; lb--){
+		if(fresh[lb - first]){
+			free_blkno(bmap(inode, lb));
+			bmap_set(inode, lb, 0);
+		}
+	}
+	free(fresh);
 
-	// Note: this function should return the amount of bytes you copied to buffer
-	return 0;
+	// Step 5: Update the inode info
+	if(done > 0){
+		if(offset + done > inode->size){
+			inode->size = offset + done;
+			inode->vstat.st_size = inode->size;
+		}
+		time(&inode->vstat.st_mtime);
+	}
+	writei(inode->ino, inode);
+	return done > 0 ? (int)done : ret;
 }
 
-static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-
-	// Step 2: Based on size and offset, read its data blocks from disk
-
-	// Step 3: Write the correct amount of data from offset to disk
+static int rufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	size_t size = fuse_buf_size(buf);
 
-	// Step 4: Update the inode info and write it to disk
+	// Step 1: Use the open file's inode, or call get_node_by_path() without one
+	struct open_file *of = open_file_get(fi);
+	struct inode inode;
+	struct inode *ip = file_lock(path, of, 1, &inode);
+	if(ip == NULL){
+		return -ENOENT;
+	}
 
-	// Note: this function should return the amount of bytes you write to disk
-	return size;
+	// Step 2: Whole blocks go straight to the disk file when its descriptor allows
+	int ret;
+	if(size > 0 && offset%BLOCK_SIZE == 0 && size%BLOCK_SIZE == 0 && bio_fd_range(0, 0) >= 0){
+		ret = file_write_fd(of, ip, &inode, buf, offset);
+	}else{
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem = malloc(size);
+		if(mem.buf[0].mem == NULL){
+			file_unlock(ip, of);
+			return -ENOMEM;
+		}
+		ssize_t n = fuse_buf_copy(&mem, buf, 0);
+		ret = n < 0 ? (int)n : file_write(ip, &inode, mem.buf[0].mem, n, offset);
+		free(mem.buf[0].mem);
+	}
+	file_unlock(ip, of);
+	return ret;
 }
+#endif
 
+#ifndef RUFS_LOWLEVEL
 static int rufs_unlink(const char *path) {
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	char *dcopy = strdup(path), *bcopy = strdup(path);
+	if(dcopy == NULL || bcopy == NULL){
+		free(dcopy);
+		free(bcopy);
+		return -ENOMEM;
+	}
+	const char *dir = dirname(dcopy), *name = basename(bcopy);
+	struct inode parent, inode;
 
 	// Step 2: Call get_node_by_path() to get inode of target file
+	int ret = get_node_by_path(path, root_ino, &inode);
+	if(ret == 0 && inode.type != FILE_TYPE){
+		ret = -EISDIR;
+	}
 
-	// Step 3: Clear data block bitmap of target file
-
-	// Step 4: Clear inode bitmap and its data block
+	// Step 3: Call get_node_by_path() to get inode of parent directory
+	if(ret == 0){
+		ret = get_node_by_path(dir, root_ino, &parent);
+	}
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
+	// Step 4: Call dir_remove() to remove directory entry of target file in its parent directory
+	// (it names whichever file has the name now, if a racing unlink and
+	// create replaced it)
+	int ino = ret == 0 ? dir_remove(parent, name, strlen(name)) : -1;
+	free(dcopy);
+	free(bcopy);
+	if(ret < 0){
+		return ret;
+	}
+	if(ino < 0){
+		return -ENOENT;
+	}
 
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+	// Step 5: Drop the link; with no link or open handle left, clear the
+	// file's data blocks and then its inode in the bitmaps (else the last
+	// rufs_release does)
+	struct inode *ip = iget(ino);
+	if(ip == NULL){
+		return -EIO;
+	}
+	ilock(ip, 1);
+	readi(ino, &inode);
+	inode.link--;
+	inode.vstat.st_nlink = inode.link;
+	time(&inode.vstat.st_ctime);
+	int gone = inode.link == 0 && ((struct icache_entry *)ip)->nopen == 0;
+	if(gone){
+		file_free(ip, &inode);
+	}else{
+		writei(ino, &inode);
+	}
+	iunlock(ip);
+	iput(ip);
 
+	// Step 6: Free the inode number only once nothing can reach the inode
+	if(gone){
+		free_ino(ino);
+	}
 	return 0;
 }
 
 static int rufs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	struct inode inode;
+	struct inode *ip = file_lock(path, NULL, 1, &inode);
+	if(ip == NULL){
+		return -ENOENT;
+	}
+	int ret = inode.type == FILE_TYPE ? file_truncate(ip, &inode, size) : -EISDIR;
+	file_unlock(ip, NULL);
+	return ret;
 }
+#endif
 
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	// Write the file's buffered data out, then drop the pin rufs_open took;
+	// the last handle on an unlinked file frees it
+	struct open_file *of = open_file_get(fi);
+	int ret = 0;
+	if(of != NULL){
+		struct inode inode;
+		struct inode *ip = file_lock(path, of, 1, &inode);
+		int last = --((struct icache_entry *)ip)->nopen == 0 && inode.link == 0;
+		if(last){
+			file_free(ip, &inode);
+		}else if(file_writeback(ip, &inode) < 0){
+			ret = -EIO;
+		}
+		file_unlock(ip, of);
+		iput(of->ip);
+		if(last){
+			free_ino(of->ino);
+		}
+		pthread_mutex_destroy(&of->lock);
+		free(of);
+	}
+	fi->fh = 0;
+	return ret;
 }
 
 static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Write back the open file's buffered data (every file's without a
+	// handle) into the block cache; the rest of the disk is left for
+	// fsync, eviction and unmount, so closing a file stays cheap
+	struct open_file *of = open_file_get(fi);
+	int ret = 0;
+	if(of != NULL){
+		struct inode inode;
+		struct inode *ip = file_lock(path, of, 1, &inode);
+		ret = file_writeback(ip, &inode);
+		file_unlock(ip, of);
+	}else{
+		ret = file_writeback_all();
+	}
+	return ret < 0 ? -EIO : 0;
+}
+
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	// Flush as rufs_flush does, push dirty inodes and bitmaps and all
+	// dirty blocks out of the block cache, then wait for the disk file to
+	// be durable; the disk file never changes size, so datasync makes no
+	// difference
+	int ret = rufs_flush(path, fi);
+	if(ret == 0 && (icache_flush() < 0 || bitmaps_flush() < 0 || bio_flush() < 0 || bio_sync() < 0)){
+		ret = -EIO;
+	}
+	return ret;
 }
 
+#ifndef RUFS_LOWLEVEL
 static int rufs_utimens(const char *path, const struct timespec tv[2]) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
@@ -685,25 +4441,480 @@ static struct fuse_operations rufs_ope = {
 	.open		= rufs_open,
 	.read 		= rufs_read,
 	.write		= rufs_write,
+#if FUSE_VERSION >= 29
+	.read_buf	= rufs_read_buf,
+	.write_buf	= rufs_write_buf,
+#endif
 	.unlink		= rufs_unlink,
 
 	.truncate   = rufs_truncate,
 	.flush      = rufs_flush,
+	.fsync      = rufs_fsync,
 	.utimens    = rufs_utimens,
 	.release	= rufs_release
 };
+#endif
 
-int run_rufs(int argc, char *argv[])
-{
-    int fuse_stat;
+/*
+ * Refuse a disk file that is there but holds no file system this build can
+ * mount (another magic number or block size, or a damaged super block),
+ * rather than let rufs_init() format over it. A missing disk file is fine:
+ * mkfs makes it.
+ */
+static int disk_check(const char *path) {
+	struct superblock sb;
+
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		if(errno == ENOENT){
+			return 0;
+		}
+		perror(path);
+		return -1;
+	}
+	ssize_t n = pread(fd, &sb, sizeof(sb), (off_t)super_num * BLOCK_SIZE);
+	close(fd);
+	if(n != sizeof(sb) || sb.magic_num != MAGIC_NUM || sb.blk_size != BLOCK_SIZE){
+		fprintf(stderr, "%s: not a RUFS disk this version can mount; move it away to make a new one\n", path);
+		return -1;
+	}
+	return 0;
+}
 
+//Take the RUFS options out of args and set up the disk file and backend
+static int rufs_parse_opts(struct fuse_args *args) {
     getcwd(diskfile_path, PATH_MAX);
     strcat(diskfile_path, "/DISKFILE");
 
-    fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	if(fuse_opt_parse(args, &rufs_opts, rufs_opt_spec, NULL) == -1){
+		return -1;
+	}
+	if(disk_check(diskfile_path) < 0){
+		return -1;
+	}
+	if(rufs_opts.size_str != NULL){
+		char *end;
+		rufs_opts.disk_size = strtoull(rufs_opts.size_str, &end, 0);
+		switch(*end){
+		case 'g': case 'G': rufs_opts.disk_size <<= 10; /* fall through */
+		case 'm': case 'M': rufs_opts.disk_size <<= 10; /* fall through */
+		case 'k': case 'K': rufs_opts.disk_size <<= 10;
+		}
+	}
+	if(rufs_opts.mmap){
+		dev_set_backend(DEV_MMAP);
+	}else{
+		dev_set_backend((rufs_opts.uring ? DEV_URING : DEV_PREAD) |
+				(rufs_opts.direct ? DEV_DIRECT : 0));
+	}
+	if(rufs_opts.dirty_limit > 0){
+		bio_set_dirty_limit(rufs_opts.dirty_limit);
+	}
+	return 0;
+}
+
+#ifndef RUFS_LOWLEVEL
+int run_rufs(int argc, char *argv[])
+{
+    int fuse_stat;
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(rufs_parse_opts(&args) < 0){
+		return 1;
+	}
+	// Every change goes through this mount, so the kernel may keep entries
+	// and attributes for a while (options given later still win)
+	if(fuse_opt_insert_arg(&args, 1, "-oentry_timeout=60,negative_timeout=60,attr_timeout=60") < 0){
+		return 1;
+	}
+    fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
 
+	fuse_opt_free_args(&args);
     return fuse_stat;
 }
+#else
+/*
+ * FUSE low-level operations
+ *
+ * Built with -DRUFS_LOWLEVEL against FUSE 3 (make rufs_ll), RUFS serves
+ * the kernel by inode number rather than by path. The FUSE node ID of an
+ * inode is its RUFS number plus one, as FUSE keeps 0 unused and gives the
+ * root ID 1. lookup resolves a single name, and the entries and
+ * attributes it returns may be cached by the kernel for LL_TIMEOUT
+ * seconds, so repeated path walks and stats mostly stay in the kernel's
+ * dentry and attribute caches. Every change to the disk goes through this
+ * mount, which keeps those caches coherent. Open files are served by the
+ * same code as the path-based frontend, through the open-file handle.
+ */
+#define LL_TIMEOUT		60.0
+#define LL_INO(nodeid)	((int)(nodeid) - 1)
+#define LL_NODEID(ino)	((fuse_ino_t)(ino) + 1)
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+	rufs_init(conn);
+}
+
+//inode_stat() with the FUSE node ID as inode number
+static void ll_stat(const struct inode *inode, struct stat *st) {
+	inode_stat(inode, st);
+	st->st_ino = LL_NODEID(inode->ino);
+}
+
+//Fill e with the entry for inode ino, or return -1 if there is none
+static int ll_entry(int ino, struct fuse_entry_param *e) {
+	struct inode inode;
+	if(ino < 0 || readi(ino, &inode) < 0 || !inode.valid){
+		return -1;
+	}
+	memset(e, 0, sizeof(*e));
+	e->ino = LL_NODEID(ino);
+	e->attr_timeout = LL_TIMEOUT;
+	e->entry_timeout = LL_TIMEOUT;
+	ll_stat(&inode, &e->attr);
+	return 0;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	int dir = LL_INO(parent);
+	size_t len = strlen(name);
+	struct fuse_entry_param e;
+	struct dirent ent;
+
+	if(len >= sizeof(ent.name)){
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	int ino = dcache_lookup(dir, name, len);
+	if(ino < 0 && ino != DCACHE_NEG){
+		ino = dir_find(dir, name, len, &ent) < 0 ? -1 : ent.ino;
+	}
+	if(ino < 0){
+		// the kernel caches the miss too (node ID 0)
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = LL_TIMEOUT;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if(ll_entry(ino, &e) < 0){
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+/*
+ * The low-level frontend has no unlink or rmdir, so no inode it hands out
+ * is ever freed and the kernel's lookup counts need not be tracked
+ */
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct inode inode;
+	struct stat st;
+	if(readi(LL_INO(ino), &inode) < 0 || !inode.valid){
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ll_stat(&inode, &st);
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+/*
+ * Change the size, mode, owner or times of an inode. Size changes come
+ * with the writeback cache's truncates and O_TRUNC opens, and time changes
+ * with its flushes of cached writes.
+ */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	struct open_file *of = open_file_get(fi);
+	struct inode inode;
+	struct inode *ip = of != NULL ? of->ip : iget(LL_INO(ino));
+	struct stat st;
+	int ret = 0;
+
+	if(ip == NULL){
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ilock(ip, 1);
+	if(readi(LL_INO(ino), &inode) < 0 || !inode.valid){
+		ret = -ENOENT;
+	}else if(to_set & FUSE_SET_ATTR_SIZE){
+		ret = inode.type == FILE_TYPE ? file_truncate(ip, &inode, attr->st_size) : -EISDIR;
+	}
+	if(ret == 0){
+		if(to_set & FUSE_SET_ATTR_MODE){
+			inode.vstat.st_mode = (inode.vstat.st_mode & S_IFMT) | (attr->st_mode & 07777);
+		}
+		if(to_set & FUSE_SET_ATTR_UID){
+			inode.vstat.st_uid = attr->st_uid;
+		}
+		if(to_set & FUSE_SET_ATTR_GID){
+			inode.vstat.st_gid = attr->st_gid;
+		}
+		if(to_set & FUSE_SET_ATTR_ATIME_NOW){
+			time(&inode.vstat.st_atime);
+		}else if(to_set & FUSE_SET_ATTR_ATIME){
+			inode.vstat.st_atime = attr->st_atime;
+		}
+		if(to_set & FUSE_SET_ATTR_MTIME_NOW){
+			time(&inode.vstat.st_mtime);
+		}else if(to_set & FUSE_SET_ATTR_MTIME){
+			inode.vstat.st_mtime = attr->st_mtime;
+		}
+		time(&inode.vstat.st_ctime);
+		writei(inode.ino, &inode);
+		ll_stat(&inode, &st);
+	}
+	iunlock(ip);
+	if(of == NULL){
+		iput(ip);
+	}
+	if(ret < 0){
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct inode inode;
+	if(readi(LL_INO(ino), &inode) < 0 || !inode.valid){
+		fuse_reply_err(req, ENOENT);
+	}else if(inode.type == FILE_TYPE){
+		fuse_reply_err(req, ENOTDIR);
+	}else{
+		fuse_reply_open(req, fi);
+	}
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, 0);
+}
+
+//Directory listing for readdir, or with attributes for readdirplus
+static void ll_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, int plus) {
+	struct dir_batch *b = malloc(sizeof(*b));
+	char *buf = malloc(size);
+	size_t len = 0;
+	int full = 0;
+
+	if(b == NULL || buf == NULL){
+		free(b);
+		free(buf);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	do{
+		if(dir_batch_read(LL_INO(ino), off, b) < 0){
+			free(b);
+			free(buf);
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		for(int i = 0; i < b->n && !full; i++){
+			const struct dirent *ent = &b->ents[i];
+			size_t n;
+			if(plus){
+				// "." and ".." go without an entry, the kernel takes no reference on them
+				struct fuse_entry_param e;
+				memset(&e, 0, sizeof(e));
+				if(b->inodes[i].valid && strcmp(ent->name, ".") != 0 && strcmp(ent->name, "..") != 0){
+					e.ino = LL_NODEID(ent->ino);
+					e.attr_timeout = LL_TIMEOUT;
+					e.entry_timeout = LL_TIMEOUT;
+				}
+				ll_stat(&b->inodes[i], &e.attr);
+				e.attr.st_ino = LL_NODEID(ent->ino);
+				n = fuse_add_direntry_plus(req, buf + len, size - len, ent->name, &e, b->next[i]);
+			}else{
+				struct stat st;
+				ll_stat(&b->inodes[i], &st);
+				st.st_ino = LL_NODEID(ent->ino);
+				n = fuse_add_direntry(req, buf + len, size - len, ent->name, &st, b->next[i]);
+			}
+			if(n > size - len){
+				full = 1;
+			}else{
+				len += n;
+				off = b->next[i];
+			}
+		}
+	}while(!full && b->n == DIR_BATCH);
+	fuse_reply_buf(req, buf, len);
+	free(b);
+	free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	ll_do_readdir(req, ino, size, off, 0);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	ll_do_readdir(req, ino, size, off, 1);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct inode dir, inode;
+	struct fuse_entry_param e;
+
+	if(readi(LL_INO(parent), &dir) < 0 || !dir.valid){
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	int ret = file_create(&dir, name, strlen(name), mode, ctx->uid, ctx->gid, &inode);
+	if(ret == 0){
+		ret = open_file_new(inode.ino, fi);
+	}
+	if(ret < 0){
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	// the kernel never sees a handle it got no entry for, so close it here
+	if(ll_entry(inode.ino, &e) < 0){
+		rufs_release(NULL, fi);
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	fuse_reply_create(req, &e, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct inode inode;
+	if(readi(LL_INO(ino), &inode) < 0 || !inode.valid){
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if(inode.type != FILE_TYPE){
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	int ret = open_file_new(inode.ino, fi);
+	if(ret < 0){
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	// Reply with the file still locked, so the blocks FD buffers name
+	// cannot be freed and reused before they are spliced
+	struct open_file *of = open_file_get(fi);
+	struct fuse_bufvec *vec;
+	struct inode inode;
+	struct inode *ip = file_lock(NULL, of, 0, &inode);
+	if(ip == NULL){
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	int ret = file_read_buf(of, ip, &inode, &vec, size, off, 1);
+	if(ret < 0){
+		file_unlock(ip, of);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_data(req, vec, 0);
+	file_unlock(ip, of);
+	bufvec_free(vec);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+	int ret = rufs_write_buf(NULL, bufv, off, fi);
+	if(ret < 0){
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_write(req, ret);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -rufs_flush(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -rufs_fsync(NULL, datasync, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -rufs_release(NULL, fi));
+}
+
+static const struct fuse_lowlevel_ops rufs_ll_ope = {
+	.init			= ll_init,
+	.destroy		= rufs_destroy,
+
+	.lookup			= ll_lookup,
+	.forget			= ll_forget,
+	.forget_multi	= ll_forget_multi,
+	.getattr		= ll_getattr,
+	.setattr		= ll_setattr,
+	.opendir		= ll_opendir,
+	.readdir		= ll_readdir,
+	.readdirplus	= ll_readdirplus,
+	.releasedir		= ll_releasedir,
+
+	.create			= ll_create,
+	.open			= ll_open,
+	.read			= ll_read,
+	.write_buf		= ll_write_buf,
+	.flush			= ll_flush,
+	.fsync			= ll_fsync,
+	.release		= ll_release
+};
+
+int run_rufs(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	int ret = 1;
+
+	if(rufs_parse_opts(&args) < 0 || fuse_parse_cmdline(&args, &opts) != 0){
+		return 1;
+	}
+	if(opts.show_help){
+		printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto out;
+	}
+	if(opts.show_version){
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out;
+	}
+	if(opts.mountpoint == NULL){
+		printf("usage: %s [options] <mountpoint>\n", argv[0]);
+		goto out;
+	}
+
+	se = fuse_session_new(&args, &rufs_ll_ope, sizeof(rufs_ll_ope), NULL);
+	if(se == NULL){
+		goto out;
+	}
+	if(fuse_set_signal_handlers(se) == 0){
+		if(fuse_session_mount(se, opts.mountpoint) == 0){
+			fuse_daemonize(opts.foreground);
+			ret = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+			fuse_session_unmount(se);
+		}
+		fuse_remove_signal_handlers(se);
+	}
+	fuse_session_destroy(se);
+out:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret;
+}
+#endif
 
 #ifndef RUFS_MAIN
 int main(int argc, char *argv[]) {
@@ -718,7 +4929,17 @@ TO START
 
 make
 mkdir -p /tmp/mc2432/mountdir
-./rufs -s /tmp/mc2432/mountdir
+./rufs /tmp/mc2432/mountdir
+(RUFS runs under FUSE's multithreaded loop; add -s to use a single thread)
+
+A new DISKFILE can be given a different geometry, e.g.
+./rufs -o disk_size=1G,inodes=16384 /tmp/mc2432/mountdir
+(other options: -o mmap, -o uring, -o direct; -o compact_dirs gives a new
+DISKFILE variable-length directory entries and -o extents maps its files
+with extent trees)
+
+make rufs_ll builds the same file system on the FUSE 3 low-level API
+(needs libfuse3); ./rufs_ll takes the same options
 
 cd benchark
 make
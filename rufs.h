@@ -33,32 +33,95 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#define MAGIC_NUM 0x5C3B
+/* Geometry used by mkfs unless -o disk_size= / -o inodes= say otherwise */
+#define DEFAULT_DISK_SIZE (32*1024*1024)
+#define DEFAULT_INUM 1024
+/* Inode numbers are stored in 16 bits in inodes and directory entries */
+#define MAX_INUM_LIMIT 65536
 
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
+	uint32_t	max_inum;			/* maximum inode number */
+	uint32_t	max_dnum;			/* maximum data block number */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	blk_size;			/* block size the disk was made with */
+	uint64_t	disk_size;			/* size of the disk in bytes */
+	uint32_t	features;			/* FEATURE_* flags chosen at mkfs time */
+	uint32_t	group_inodes;		/* inodes per allocation group (0: a single group) */
+	uint32_t	group_blks;			/* data blocks per allocation group (0: a single group) */
 };
 
+/* Allocation groups: mkfs aims for GROUP_TARGET groups of GROUP_MIN_BLKS..GROUP_MAX_BLKS blocks */
+#define GROUP_TARGET	8
+#define GROUP_MIN_BLKS	2048
+#define GROUP_MAX_BLKS	(BLOCK_SIZE*8)
+
+/* superblock feature flags */
+#define FEATURE_COMPACT_DIRENT	0x01	/* directory blocks hold struct dirent_rec records */
+#define FEATURE_EXTENTS			0x02	/* new files are mapped by extent trees */
+
 struct inode {
 	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		flags;				/* INODE_* layout flags */
 	uint32_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* indirect pointer to data block */
+		};
+		uint32_t	ext_root[24];		/* INODE_EXTENTS: root node of the extent tree */
+	};
 	struct stat	vstat;				/* inode stat */
 };
 
+/*
+ * Block map: direct_ptr holds the first NDIRECT blocks of a file,
+ * indirect_ptr[0..NINDIRECT-1] point at single-indirect blocks and the
+ * remaining indirect_ptr slots at double-indirect blocks
+ */
+#define NDIRECT			16
+#define NINDIRECT		6
+#define NDINDIRECT		(8 - NINDIRECT)
+#define PTRS_PER_BLK	((int)(BLOCK_SIZE/sizeof(int)))
+
+/* inode flags */
+#define INODE_DIR_HASHED	0x01	/* directory uses a hashed index (struct dir_index) */
+#define INODE_EXTENTS		0x02	/* file is mapped by an extent tree (ext_root) */
+
+/*
+ * Extent trees
+ * Every node, the root in the inode and the rest a block each, is an
+ * ext_header followed by entries sorted by lblk. A leaf (depth 0) entry
+ * maps len blocks from lblk to pblk; an index entry points pblk at the
+ * child node holding lblk onwards.
+ */
+#define EXT_MAGIC	0xE57A
+
+struct ext_header {
+	uint16_t	magic;				/* EXT_MAGIC */
+	uint16_t	entries;			/* entries in use */
+	uint16_t	max;				/* entries this node has room for */
+	uint16_t	depth;				/* 0 for a leaf, else levels below */
+};
+
+struct extent {
+	uint32_t	lblk;				/* first logical block covered */
+	uint32_t	pblk;				/* first disk block, or child node block */
+	uint32_t	len;				/* blocks mapped (leaves only) */
+};
+
+#define EXT_ROOT_MAX	((sizeof(((struct inode *)0)->ext_root) - sizeof(struct ext_header)) / sizeof(struct extent))
+#define EXT_NODE_MAX	((BLOCK_SIZE - sizeof(struct ext_header)) / sizeof(struct extent))
+#define EXT_ENTS(h)		((struct extent *)((struct ext_header *)(h) + 1))
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
@@ -66,6 +129,47 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * Variable-length directory record (FEATURE_COMPACT_DIRENT)
+ * Records are packed from the start of a directory block, each rec_len
+ * bytes long (4-byte aligned); a rec_len of 0 ends the block.
+ */
+struct dirent_rec {
+	uint16_t ino;					/* inode number of the directory entry */
+	uint16_t rec_len;				/* bytes to the next record */
+	uint8_t name_len;				/* length of name (not NUL terminated) */
+	char name[];
+};
+
+/*
+ * Hashed directories (extendible hashing)
+ * direct_ptr[0] of the directory points at the index block. The low depth
+ * bits of a name's hash pick a bucket pointer; several pointers may share
+ * a bucket block until that bucket is split. The pointers are kept in
+ * index pages, blocks of DIRHASH_PAGE_PTRS pointers each, listed in the
+ * index block: pointer p is slot p % DIRHASH_PAGE_PTRS of page
+ * p / DIRHASH_PAGE_PTRS. At most 2^DIRHASH_MAX_DEPTH buckets, room for
+ * well over MAX_INUM_LIMIT entries even when the hashes are uneven.
+ */
+#define DIRHASH_PAGE_SHIFT	10
+#define DIRHASH_PAGE_PTRS	(1 << DIRHASH_PAGE_SHIFT)	/* BLOCK_SIZE / sizeof(uint32_t) */
+#define DIRHASH_MAX_DEPTH	16
+#define DIRHASH_PAGES		((1 << DIRHASH_MAX_DEPTH) / DIRHASH_PAGE_PTRS)
+
+struct dir_index {
+	uint32_t	depth;				/* global depth: 2^depth pointers in use */
+	uint32_t	nbuckets;			/* number of distinct bucket blocks */
+	uint32_t	npages;				/* index pages in use */
+	uint32_t	page[DIRHASH_PAGES];	/* index page blocks, in pointer order */
+};
+
+struct dir_bucket {
+	uint16_t	depth;				/* local depth: hash bits shared by entries */
+	uint16_t	count;				/* valid entries in this bucket */
+	uint32_t	reserved;
+	unsigned char ents[];			/* entries (either format) fill the rest of the block */
+};
+
 
 /*
  * bitmap operations
@@ -75,20 +179,50 @@ typedef unsigned char* bitmap_t;
 void set_bitmap(bitmap_t b, int i);
 void unset_bitmap(bitmap_t b, int i);
 uint8_t get_bitmap(bitmap_t b, int i);
+int bitmap_find_zero(bitmap_t b, int nbits, int hint);
 
 
+int bitmaps_load();
+int bitmaps_flush();
 int get_avail_ino();
+int get_avail_ino_near(int parent_ino);
 int get_avail_blkno();
+void alloc_near(int ino);
+int get_avail_extent(int want, int *start, int *len);
+int blocks_reserve(int n);
+void blocks_unreserve(int n);
+int blocks_free();
+void free_ino(int ino);
+void free_blkno(int blkno);
+struct inode *iget(uint16_t ino);
+void iput(struct inode *inode);
+void idirty(struct inode *inode);
+void ilock(struct inode *inode, int write);
+void iunlock(struct inode *inode);
+int icache_flush();
 int readi(uint16_t ino, struct inode *inode);
+int readi_many(int n, const uint16_t *inos, struct inode *inodes);
+int bmap(struct inode *inode, int lb);
+int bmap_set(struct inode *inode, int lb, int blk);
+int bmap_set_range(struct inode *inode, int lb, int blk, int count);
+int bmap_truncate(struct inode *inode, int nb);
+unsigned int bmap_generation();
+int bmap_extent(struct inode *inode, int lb, int *len);
+void bmap_format(struct inode *inode);
 int writei(uint16_t ino, struct inode *inode);
+int dcache_lookup(uint16_t parent, const char *name, size_t len);
+void dcache_insert(uint16_t parent, const char *name, size_t len, int ino);
+void dcache_purge(uint16_t parent);
 int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent);
 int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len);
 int dir_remove(struct inode dir_inode, const char *fname, size_t name_len);
+int dir_foreach(uint16_t ino, off_t off, int (*fn)(void *arg, const struct dirent *ent, off_t next), void *arg);
 int get_node_by_path(const char *path, uint16_t ino, struct inode *inode);
-int rufs_mkfs();
+int rufs_mkfs(uint64_t disk_size, uint32_t ninodes, uint32_t blk_size, uint32_t features);
 
 static void *rufs_init(struct fuse_conn_info *conn);
 static void rufs_destroy(void *userdata);
+#ifndef RUFS_LOWLEVEL
 static int rufs_getattr(const char *path, struct stat *stbuf);
 static int rufs_opendir(const char *path, struct fuse_file_info *fi);
 static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
@@ -103,9 +237,13 @@ static int rufs_unlink(const char *path);
 
 
 static int rufs_truncate(const char *path, off_t size);
+#endif
 static int rufs_release(const char *path, struct fuse_file_info *fi);
 static int rufs_flush(const char * path, struct fuse_file_info * fi);
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+#ifndef RUFS_LOWLEVEL
 static int rufs_utimens(const char *path, const struct timespec tv[2]);
+#endif
 
 
 int run_rufs(int argc, char *argv[]);
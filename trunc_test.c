@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./rufs.h"
+
+/*
+ * Truncate test: make a disk with extents, write a file one block at a
+ * time with gaps between the blocks (so every block is its own extent and
+ * the tree grows index nodes), truncate it in steps and write it again,
+ * checking the data left after every step and that truncating to nothing
+ * gives back every block, extent tree nodes included. A file mapped by
+ * block pointers on the same disk gets the same treatment.
+ */
+
+#define DISKFILE_PATH "trunc_test_DISKFILE"
+
+// Blocks go at every other logical block, so NBLKS blocks are NBLKS
+// extents: more than the root and one level of leaves can hold
+#define NBLKS 3000
+#define SPAN (2 * NBLKS)
+#define STEP 377
+
+extern char diskfile_path[PATH_MAX];
+
+static char buf[BLOCK_SIZE];
+
+// The byte every block written to lb is filled with
+static int fill(int lb, int round) {
+    return (lb / 2 + round) % 251 + 1;
+}
+
+static int write_file(struct inode *inode, int from, int round) {
+    for (int lb = from; lb < SPAN; lb += 2) {
+        int blk = get_avail_blkno();
+        if (blk < 0) {
+            printf("Out of blocks at block %d.\n", lb);
+            return -1;
+        }
+        memset(buf, fill(lb, round), BLOCK_SIZE);
+        if (bio_write(blk, buf) < 0 || bmap_set(inode, lb, blk) < 0) {
+            printf("Writing block %d failed.\n", lb);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Blocks before nb hold what round wrote (or from_round, below from),
+// the ones after are unmapped
+static int check(struct inode *inode, int nb, int from, int round, int from_round, const char *step) {
+    for (int lb = 0; lb < SPAN; lb++) {
+        int blk = bmap(inode, lb);
+        if (lb >= nb || lb % 2 != 0) {
+            if (blk != 0) {
+                printf("%s: block %d maps to %d, expected a hole\n", step, lb, blk);
+                return -1;
+            }
+            continue;
+        }
+        int want = fill(lb, lb < from ? from_round : round);
+        if (blk == 0 || bio_read(blk, buf) < 0 || buf[0] != (char)want || buf[BLOCK_SIZE - 1] != (char)want) {
+            printf("%s: block %d does not hold its data\n", step, lb);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run(struct inode *inode, const char *name) {
+    int start = blocks_free();
+
+    if (write_file(inode, 0, 0) < 0 || check(inode, SPAN, 0, 0, 0, name) < 0) {
+        return -1;
+    }
+    printf("%s: written, %d blocks used\n", name, start - blocks_free());
+
+    // Cut the file down a bit at a time, each cut ending inside a node
+    for (int nb = SPAN - STEP; nb > 0; nb -= STEP) {
+        if (bmap_truncate(inode, nb) < 0 || check(inode, nb, 0, 0, 0, name) < 0) {
+            printf("%s: truncating to %d blocks failed\n", name, nb);
+            return -1;
+        }
+    }
+
+    // Write it again past what the last cut kept, then cut it to nothing
+    int kept = SPAN % STEP;
+    if (write_file(inode, kept + kept % 2, 1) < 0 || check(inode, SPAN, kept, 1, 0, name) < 0) {
+        return -1;
+    }
+    if (bmap_truncate(inode, 0) < 0 || check(inode, 0, 0, 0, 0, name) < 0) {
+        return -1;
+    }
+    if (blocks_free() != start) {
+        printf("%s: %d blocks free after truncating to 0, expected %d\n", name, blocks_free(), start);
+        return -1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+int main() {
+    struct inode inode;
+
+    strcpy(diskfile_path, DISKFILE_PATH);
+    unlink(DISKFILE_PATH);
+    if (rufs_mkfs(DEFAULT_DISK_SIZE, DEFAULT_INUM, BLOCK_SIZE, FEATURE_EXTENTS) < 0) {
+        printf("mkfs failed.\n");
+        return 1;
+    }
+
+    memset(&inode, 0, sizeof(inode));
+    bmap_format(&inode);
+    if (!(inode.flags & INODE_EXTENTS)) {
+        printf("File not mapped by an extent tree.\n");
+        return 1;
+    }
+    if (run(&inode, "extents") < 0) {
+        return 1;
+    }
+    if (((struct ext_header *)inode.ext_root)->depth != 0) {
+        printf("Empty extent tree left at depth %d.\n", ((struct ext_header *)inode.ext_root)->depth);
+        return 1;
+    }
+
+    // A file with no layout set up is mapped by block pointers
+    memset(&inode, 0, sizeof(inode));
+    if (run(&inode, "pointers") < 0) {
+        return 1;
+    }
+
+    unlink(DISKFILE_PATH);
+    printf("Test completed.\n");
+    return 0;
+}